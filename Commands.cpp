@@ -11,30 +11,42 @@
 #include <sys/sysinfo.h>
 #include <time.h>
 #include <cstdio>
+#include <cstddef>
 #include <cstring>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 #include <limits.h>
 #include <ctype.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <spawn.h>
+#include <errno.h>
 #include "signals.h"
 using namespace std;
 
 const std::string WHITESPACE = " \n\r\t\f\v";
 
-#if 0
-#define FUNC_ENTRY()  \
-  cout << __PRETTY_FUNCTION__ << " --> " << endl;
-
-#define FUNC_EXIT()  \
-  cout << __PRETTY_FUNCTION__ << " <-- " << endl;
-#else
-#define FUNC_ENTRY()
-#define FUNC_EXIT()
-#endif
-
 
 //start of: helper functions --------------------------------------------------------------------
 
@@ -56,18 +68,55 @@ string _trim(const std::string &s) {
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char *cmd_line, char **args) {
-    FUNC_ENTRY()
-    int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for (std::string s; iss >> s;) {
-        args[i] = (char *) malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = NULL;
+CommandArgs::CommandArgs(const char *cmd_line): buffer(cmd_line ? cmd_line : "") {
+    // count the tokens first so the argv vector is allocated exactly once
+    size_t count = 0;
+    bool in_token = false;
+    for (char c : buffer) {
+        bool is_space = WHITESPACE.find(c) != std::string::npos;
+        if (!is_space && !in_token) {
+            count++;
+        }
+        in_token = !is_space;
+    }
+    args.reserve(count + 1);
+
+    size_t i = 0;
+    while (i < buffer.size()) {
+        i = buffer.find_first_not_of(WHITESPACE, i);
+        if (i == std::string::npos) {
+            break;
+        }
+        size_t end = buffer.find_first_of(WHITESPACE, i);
+        if (end == std::string::npos) {
+            end = buffer.size();
+        }
+        args.push_back(&buffer[i]);
+        if (end < buffer.size()) {
+            buffer[end] = '\0'; // terminate the token in place
+        }
+        i = end + 1;
+    }
+    args.push_back(nullptr);
+}
+
+bool CommandArgs::stripBackground() {
+    int argc = size();
+    if (argc == 0) {
+        return false;
+    }
+    char *last = args[argc - 1];
+    size_t len = strlen(last);
+    if (last[len - 1] != '&') {
+        return false;
     }
-    return i;
-    FUNC_EXIT()
+    if (len == 1) {
+        args.erase(args.begin() + (argc - 1));
+    }
+    else {
+        last[len - 1] = '\0';
+    }
+    return true;
 }
 
 bool _isBackgroundComamnd(const char *cmd_line) {
@@ -87,122 +136,1984 @@ void _removeBackgroundSign(char *cmd_line) {
     if (cmd_line[idx] != '&') {
         return;
     }
-    // replace the & (background sign) with space and then remove all tailing spaces.
-    cmd_line[idx] = ' ';
-    // truncate the command line string up to the last non-space character
-    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+    // replace the & (background sign) with space and then remove all tailing spaces.
+    cmd_line[idx] = ' ';
+    // truncate the command line string up to the last non-space character
+    cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+}
+
+
+// the first line of data, trimmed; false if that line is empty
+static bool first_line(const char *data, std::string& out) {
+    std::string s(data);
+
+    // cut at newline
+    size_t pos = s.find_first_of("\r\n");
+    if (pos != std::string::npos) {
+        s = s.substr(0, pos);
+    }
+
+    out = _trim(s);
+    return !out.empty();
+}
+
+// reads up to the first line break of fd and closes it; false if that line is empty
+static bool read_first_line_fd(int fd, std::string& out) {
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = '\0';
+    return first_line(buf, out);
+}
+
+static bool read_first_line_at(int dir_fd, const char *name, std::string& out) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    return read_first_line_fd(fd, out);
+}
+
+/**
+ * Reads many small files (sysfs attributes, /proc entries) with few syscalls.
+ * With io_uring the opens of a batch are submitted at once, then the reads, then the
+ * closes, so up to RING_ENTRIES files cost three io_uring_enter calls. The phases are
+ * separate because a linked openat -> read chain needs direct descriptors (Linux 5.15+).
+ * The ring is opt-in (SMASH_IO=uring): on small machines it measured no faster than the
+ * blocking calls (bench/usbinfo_scan.sh). Without it (the default, old kernel or headers,
+ * forbidden by seccomp) every file is read with plain blocking calls. When io_uring_enter
+ * fails, every sqe the kernel took is waited for before its fd or buffer is touched.
+ */
+class BatchFileReader {
+public:
+    struct Request {
+        int dir_fd; // path is relative to this, AT_FDCWD for the working directory
+        std::string path;
+        size_t size_hint; // the first read asks for this much, a file filling it is read on to EOF
+        std::string data;
+        int open_error; // errno of the open, 0 if it succeeded
+        int read_error; // errno of a read, 0 if the whole file was read
+
+        Request(int dir_fd, const std::string& path, size_t size_hint)
+                : dir_fd(dir_fd), path(path), size_hint(size_hint), open_error(0), read_error(0) {}
+    };
+
+    static BatchFileReader& instance() {
+        static BatchFileReader reader;
+        return reader;
+    }
+
+    bool usesRing() const {
+        return ring_fd != -1;
+    }
+
+    void read(std::vector<Request>& requests) {
+        for (size_t begin = 0; begin < requests.size(); begin += RING_ENTRIES) {
+            size_t end = std::min(requests.size(), begin + RING_ENTRIES);
+            if (!usesRing() || !readRing(requests, begin, end)) {
+                for (size_t i = begin; i < end; ++i) {
+                    readBlocking(requests[i]);
+                }
+            }
+        }
+    }
+
+private:
+    static const unsigned RING_ENTRIES = 128;
+    int ring_fd = -1;
+
+    static void readBlocking(Request& request) {
+        int fd = openat(request.dir_fd, request.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            request.open_error = errno;
+            return;
+        }
+        request.data.clear();
+        readRest(fd, request);
+        close(fd);
+    }
+
+    // appends everything from the current data size to EOF
+    static void readRest(int fd, Request& request) {
+        for (;;) {
+            size_t have = request.data.size();
+            request.data.resize(have + std::max<size_t>(request.size_hint, 4096));
+            ssize_t n = pread(fd, &request.data[have], request.data.size() - have, have);
+            if (n == -1 && errno == EINTR) {
+                request.data.resize(have);
+                continue;
+            }
+            request.data.resize(have + (n > 0 ? n : 0));
+            if (n == -1) {
+                request.read_error = errno;
+            }
+            if (n <= 0) {
+                return;
+            }
+        }
+    }
+
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) // 5.6 headers: openat, read, close
+    static const int PENDING = INT_MIN; // a runPhase result whose cqe did not arrive
+    void *ring_map = MAP_FAILED;
+    size_t ring_map_size = 0;
+    void *sqe_map = MAP_FAILED;
+    size_t sqe_map_size = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned *sq_array = nullptr;
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+
+    BatchFileReader() {
+        const char *env = getenv("SMASH_IO");
+        if (!env || strcmp(env, "uring") != 0) {
+            return;
+        }
+        struct io_uring_params params = {};
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+        if (fd == -1) {
+            return;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !supportsOps(fd)) {
+            close(fd);
+            return;
+        }
+        ring_fd = fd;
+        ring_map_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                 params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        ring_map = mmap(nullptr, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+        sqe_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqe_map = mmap(nullptr, sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (ring_map == MAP_FAILED || sqe_map == MAP_FAILED) {
+            disableRing();
+            return;
+        }
+        char *base = static_cast<char *>(ring_map);
+        sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+        sqes = static_cast<struct io_uring_sqe *>(sqe_map);
+        cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+    }
+
+    ~BatchFileReader() {
+        if (ring_fd != -1) {
+            disableRing();
+        }
+    }
+
+    // after a failed io_uring_enter the ring state is unknown, later batches read blocking
+    void disableRing() {
+        if (ring_map != MAP_FAILED) {
+            munmap(ring_map, ring_map_size);
+            ring_map = MAP_FAILED;
+        }
+        if (sqe_map != MAP_FAILED) {
+            munmap(sqe_map, sqe_map_size);
+            sqe_map = MAP_FAILED;
+        }
+        close(ring_fd);
+        ring_fd = -1;
+    }
+
+    static bool supportsOps(int fd) {
+        const unsigned OPS = 64;
+        std::vector<char> buf(sizeof(struct io_uring_probe) + OPS * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, OPS) == -1) {
+            return false;
+        }
+        const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+        for (int op : needed) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    enum PhaseResult {
+        PHASE_DONE,   // every sqe completed
+        PHASE_FAILED, // io_uring_enter failed, every sqe it took has completed, the others never ran
+        PHASE_STUCK   // sqes the kernel took may still complete: their fds and buffers must stay as they are
+    };
+
+    // records the cqes that have arrived in results, without waiting
+    void harvest(size_t& completed, std::vector<int>& results) {
+        unsigned head = *cq_head;
+        unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ready; ++head) {
+            const struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            results[cqe->user_data] = cqe->res;
+            completed++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // waits until all `submitted` sqes have completed, false if the ring cannot be waited on
+    bool reap(size_t submitted, size_t& completed, std::vector<int>& results) {
+        harvest(completed, results);
+        while (completed < submitted) {
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, submitted - completed, IORING_ENTER_GETEVENTS,
+                        nullptr, 0) == -1 && errno != EINTR) {
+                return false;
+            }
+            harvest(completed, results);
+        }
+        return true;
+    }
+
+    // submits one sqe per index (fill prepares it) and waits for all of them;
+    // results[k] is the cqe result of indexes[k], PENDING where the sqe never ran (or still may)
+    template <class Fill>
+    PhaseResult runPhase(const std::vector<size_t>& indexes, Fill fill, std::vector<int>& results) {
+        unsigned tail = *sq_tail;
+        for (size_t k = 0; k < indexes.size(); ++k) {
+            unsigned slot = tail & sq_mask;
+            struct io_uring_sqe *sqe = &sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            fill(sqe, indexes[k]);
+            sqe->user_data = k;
+            sq_array[slot] = slot;
+            tail++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        results.assign(indexes.size(), static_cast<int>(PENDING));
+        size_t submitted = 0;
+        size_t completed = 0;
+        while (completed < indexes.size()) {
+            // the kernel only waits when it took every sqe passed, so this never waits for sqes it did not take
+            size_t to_submit = indexes.size() - submitted;
+            int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                               indexes.size() - completed, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            if (ret == -1 || (to_submit > 0 && ret == 0)) {
+                // nothing more was taken; the sqes taken before must land before their buffers go
+                return reap(submitted, completed, results) ? PHASE_FAILED : PHASE_STUCK;
+            }
+            submitted += ret;
+            harvest(completed, results);
+        }
+        return PHASE_DONE;
+    }
+
+    bool readRing(std::vector<Request>& requests, size_t begin, size_t end) {
+        std::vector<size_t> indexes;
+        for (size_t i = begin; i < end; ++i) {
+            indexes.push_back(i);
+        }
+        std::vector<int> results;
+        // the kernel copies the path when it takes the sqe, so a stuck open does not pin it
+        PhaseResult phase = runPhase(indexes, [&](struct io_uring_sqe *sqe, size_t i) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = requests[i].dir_fd;
+            sqe->addr = reinterpret_cast<uintptr_t>(requests[i].path.c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }, results);
+        if (phase != PHASE_DONE) {
+            for (int fd : results) {
+                if (fd >= 0) {
+                    close(fd); // opened before the failure, the blocking fallback opens again
+                }
+            }
+            disableRing(); // a stuck open may still install an fd, which is then leaked
+            return false;
+        }
+
+        std::vector<size_t> opened;
+        // indexed by i - begin; the reads land in buffers of their own, which a stuck read can keep
+        std::vector<int> fds(end - begin, -1);
+        std::vector<std::unique_ptr<char[]> > buffers(end - begin);
+        std::vector<size_t> sizes(end - begin, 0);
+        for (size_t k = 0; k < indexes.size(); ++k) {
+            size_t i = indexes[k];
+            if (results[k] < 0) {
+                requests[i].open_error = -results[k];
+                continue;
+            }
+            fds[i - begin] = results[k];
+            sizes[i - begin] = std::max<size_t>(requests[i].size_hint, 1);
+            buffers[i - begin].reset(new char[sizes[i - begin]]);
+            opened.push_back(i);
+        }
+
+        phase = runPhase(opened, [&](struct io_uring_sqe *sqe, size_t i) {
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fds[i - begin];
+            sqe->addr = reinterpret_cast<uintptr_t>(buffers[i - begin].get());
+            sqe->len = sizes[i - begin];
+            sqe->off = 0;
+        }, results);
+        if (phase != PHASE_DONE) {
+            disableRing();
+        }
+        std::vector<size_t> to_close;
+        for (size_t k = 0; k < opened.size(); ++k) {
+            size_t i = opened[k];
+            Request& request = requests[i];
+            int n = results[k];
+            if (n == PENDING) {
+                if (phase == PHASE_STUCK) {
+                    buffers[i - begin].release(); // the kernel may still write it, so it and the fd are leaked
+                    continue;
+                }
+                request.data.clear(); // never submitted
+                readRest(fds[i - begin], request);
+            }
+            else if (n < 0) {
+                request.read_error = -n;
+                request.data.clear();
+            }
+            else {
+                request.data.assign(buffers[i - begin].get(), n);
+                if (static_cast<size_t>(n) == sizes[i - begin]) {
+                    readRest(fds[i - begin], request); // larger than the hint
+                }
+            }
+            to_close.push_back(i);
+        }
+
+        if (!usesRing()) {
+            for (size_t i : to_close) {
+                close(fds[i - begin]);
+            }
+            return true;
+        }
+        phase = runPhase(to_close, [&](struct io_uring_sqe *sqe, size_t i) {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i - begin];
+        }, results);
+        if (phase != PHASE_DONE) {
+            disableRing();
+            for (size_t k = 0; k < to_close.size(); ++k) {
+                // only closes known not to have run are repeated, others could hit reused fds
+                if (phase == PHASE_FAILED && results[k] == PENDING) {
+                    close(fds[to_close[k] - begin]);
+                }
+            }
+        }
+        return true;
+    }
+#else
+    BatchFileReader() {}
+
+    bool readRing(std::vector<Request>&, size_t, size_t) {
+        return false;
+    }
+#endif
+};
+
+// one getdents64 record: the name plus the type and inode the kernel already reports
+struct DirEntry {
+    std::string name;
+    unsigned char type; // DT_* value, DT_UNKNOWN if the file system does not fill it
+    ino64_t ino;
+};
+
+static bool list_dir_fd(int fd, std::vector<DirEntry>& entries) {
+    struct linux_dirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+    const int BUF_SIZE = 32768;
+    char buf[BUF_SIZE];
+
+    for (;;) {
+        int nread = syscall(SYS_getdents64, fd, buf, BUF_SIZE);
+        if (nread == -1) {
+            return false;
+        }
+        if (nread == 0) {
+            break; // EOF
+        }
+
+        int bpos = 0;
+        while (bpos < nread) {
+            struct linux_dirent64* d =
+                (struct linux_dirent64*)(buf + bpos);
+            const char *name = d->d_name;
+
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                entries.push_back(DirEntry{name, d->d_type, d->d_ino});
+            }
+            bpos += d->d_reclen;
+        }
+    }
+
+    return true;
+}
+
+// true if word has an unescaped *, ? or [ that the glob engine would expand
+static bool has_glob_chars(const std::string& word) {
+    return word.find_first_of("*?[") != std::string::npos;
+}
+
+// lines using quoting, expansions or control syntax are still left to bash -c
+static bool needs_full_shell(const CommandArgs& args) {
+    // only literal characters and the glob's *, ? and [...] are handled natively; quotes,
+    // expansions, operators (&&, ||, ;, redirections), braces, comments, a leading ! or ~ and
+    // an assignment in front of the command all go to bash
+    for (int i = 0; i < args.size(); ++i) {
+        const char *word = args[i];
+        if (word[0] == '!' || (i == 0 && strchr(word, '=') != nullptr)) {
+            return true;
+        }
+        for (const char *p = word; *p; ++p) {
+            unsigned char c = static_cast<unsigned char>(*p);
+            if (!isalnum(c) && c < 0x80 && strchr("-_./,:+%@*?[]^!=", c) == nullptr) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// matches [set] at pattern (just past the '['); sets end to the ']' or returns false
+// with end == nullptr if the bracket is not closed, the '[' is then an ordinary char
+static bool glob_match_set(const char *pattern, char c, const char *&end) {
+    const char *p = pattern;
+    bool negate = (*p == '!' || *p == '^');
+    if (negate) {
+        p++;
+    }
+    bool matched = false;
+    bool first = true;
+    for (; *p != '\0' && (first || *p != ']'); ++p, first = false) {
+        if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+            if ((unsigned char)p[0] <= (unsigned char)c && (unsigned char)c <= (unsigned char)p[2]) {
+                matched = true;
+            }
+            p += 2;
+        }
+        else if (*p == c) {
+            matched = true;
+        }
+    }
+    if (*p != ']') {
+        end = nullptr;
+        return false;
+    }
+    end = p;
+    return matched != negate;
+}
+
+// fnmatch(3) without flags: *, ? and [...] (with ! or ^ negation and ranges)
+static bool glob_match(const char *pattern, const char *name) {
+    const char *star = nullptr; // last '*' seen, and where in name it started matching
+    const char *star_name = nullptr;
+    while (*name != '\0') {
+        const char *end = nullptr;
+        if (*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+            continue;
+        }
+        if (*pattern == '?') {
+            pattern++;
+            name++;
+            continue;
+        }
+        if (*pattern == '[' && glob_match_set(pattern + 1, *name, end)) {
+            pattern = end + 1;
+            name++;
+            continue;
+        }
+        if (*pattern != '\0' && (*pattern != '[' || end == nullptr) && *pattern == *name) {
+            pattern++;
+            name++;
+            continue;
+        }
+        if (star == nullptr) {
+            return false;
+        }
+        // let the last '*' swallow one more character and retry from there
+        pattern = star + 1;
+        name = ++star_name;
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+static bool is_dir_entry(int dir_fd, const DirEntry& entry) {
+    if (entry.type == DT_DIR) {
+        return true;
+    }
+    if (entry.type != DT_LNK && entry.type != DT_UNKNOWN) {
+        return false;
+    }
+    struct stat st;
+    return fstatat(dir_fd, entry.name.c_str(), &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Expands one glob word the way bash does without extra options: every directory on the
+ * way is read once with getdents64, names starting with '.' only match a pattern
+ * component starting with '.', results are sorted with the collation order. Returns
+ * false (and adds nothing) if nothing matched, the word is then passed on unchanged.
+ */
+static bool glob_expand(const std::string& word, std::vector<std::string>& out) {
+    std::vector<std::string> parts;
+    for (size_t begin = 0; begin < word.size();) {
+        size_t slash = word.find('/', begin);
+        size_t end = (slash == std::string::npos) ? word.size() : slash;
+        if (end > begin) {
+            parts.push_back(word.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    bool trailing_slash = word.back() == '/';
+
+    std::vector<std::string> current(1, word[0] == '/' ? "/" : "");
+    for (size_t c = 0; c < parts.size() && !current.empty(); ++c) {
+        const std::string& part = parts[c];
+        bool last = (c + 1 == parts.size());
+        bool need_dir = !last || trailing_slash;
+        std::vector<std::string> next;
+        for (const std::string& prefix : current) {
+            if (!has_glob_chars(part)) {
+                std::string path = prefix + part;
+                struct stat st;
+                if (stat(path.c_str(), &st) == 0 && (!need_dir || S_ISDIR(st.st_mode))) {
+                    next.push_back(last ? path : path + "/");
+                }
+                continue;
+            }
+            int dir_fd = open(prefix.empty() ? "." : prefix.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd == -1) {
+                continue;
+            }
+            std::vector<DirEntry> entries;
+            list_dir_fd(dir_fd, entries);
+            for (const DirEntry& entry : entries) {
+                if (entry.name[0] == '.' && part[0] != '.') {
+                    continue;
+                }
+                if (!glob_match(part.c_str(), entry.name.c_str()) || (need_dir && !is_dir_entry(dir_fd, entry))) {
+                    continue;
+                }
+                next.push_back(last ? prefix + entry.name : prefix + entry.name + "/");
+            }
+            close(dir_fd);
+        }
+        current.swap(next);
+    }
+    if (current.empty() || (current.size() == 1 && current[0] == "/")) {
+        return false;
+    }
+    std::sort(current.begin(), current.end(), [](const std::string& a, const std::string& b) {
+        return strcoll(a.c_str(), b.c_str()) < 0;
+    });
+    for (std::string& path : current) {
+        out.push_back(trailing_slash && path.back() != '/' ? path + "/" : path);
+    }
+    return true;
+}
+
+// the part of struct stat that du looks at
+struct DuStat {
+    mode_t mode;
+    unsigned long long blocks; // 512-byte units
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink;
+};
+
+/**
+ * lstat of name relative to dir_fd, asking statx for only the fields du needs so file
+ * systems such as NFS can skip the rest. Falls back to fstatat where statx is missing.
+ */
+static int du_stat(int dir_fd, const char *name, DuStat& out) {
+#ifdef STATX_BLOCKS
+    static std::atomic<bool> has_statx(true);
+    if (has_statx.load(std::memory_order_relaxed)) {
+        const unsigned int wanted = STATX_TYPE | STATX_BLOCKS | STATX_INO | STATX_NLINK;
+        struct statx stx{};
+        if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, wanted, &stx) == 0) {
+            if ((stx.stx_mask & wanted) == wanted) {
+                out.mode = stx.stx_mode;
+                out.blocks = stx.stx_blocks;
+                out.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+                out.ino = stx.stx_ino;
+                out.nlink = stx.stx_nlink;
+                return 0;
+            }
+        }
+        else if (errno == ENOSYS) {
+            has_statx.store(false, std::memory_order_relaxed);
+        }
+        else {
+            return -1;
+        }
+    }
+#endif
+    struct stat st{};
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+    out.mode = st.st_mode;
+    out.blocks = st.st_blocks;
+    out.dev = st.st_dev;
+    out.ino = st.st_ino;
+    out.nlink = st.st_nlink;
+    return 0;
+}
+
+/**
+ * Set of (st_dev, st_ino) pairs used by du to count hard-linked files once.
+ * Open addressing with linear probing over flat arrays, split into independently locked
+ * shards so the du workers rarely contend. Memory is bounded: once a shard reaches its
+ * capacity further inodes are reported as unseen, so totals degrade to counting every link
+ * instead of growing without limit.
+ */
+class InodeSet {
+private:
+    static const int SHARD_BITS = 6;
+    static const size_t SHARD_COUNT = 1 << SHARD_BITS;
+    static const size_t INITIAL_CAPACITY = 64;
+    static const size_t MAX_CAPACITY = 1 << 16; // per shard: 64 shards * 64K * 16 bytes = 64 MiB
+
+    struct Entry {
+        unsigned long long dev;
+        unsigned long long ino; // 0 marks an empty slot, no file has inode 0
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::vector<Entry> slots;
+        size_t used = 0;
+    };
+
+    Shard shards[SHARD_COUNT];
+
+    static unsigned long long hash(unsigned long long dev, unsigned long long ino) {
+        unsigned long long h = ino * 0x9E3779B97F4A7C15ULL ^ dev;
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        return h ^ (h >> 29);
+    }
+
+    static bool place(std::vector<Entry>& slots, const Entry& entry, unsigned long long h) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            if (slots[i].ino == 0) {
+                slots[i] = entry;
+                return true;
+            }
+            if (slots[i].ino == entry.ino && slots[i].dev == entry.dev) {
+                return false;
+            }
+        }
+    }
+
+    static void grow(Shard& shard, size_t capacity) {
+        std::vector<Entry> bigger(capacity, Entry{0, 0});
+        for (const auto& entry : shard.slots) {
+            if (entry.ino != 0) {
+                place(bigger, entry, hash(entry.dev, entry.ino));
+            }
+        }
+        shard.slots.swap(bigger);
+    }
+
+public:
+    // returns true the first time an inode is seen (or when it can no longer be tracked)
+    bool insert(dev_t dev, ino_t ino) {
+        unsigned long long h = hash(dev, ino);
+        Shard& shard = shards[h >> (64 - SHARD_BITS)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (shard.slots.empty()) {
+            shard.slots.assign(INITIAL_CAPACITY, Entry{0, 0});
+        }
+        // keep the load factor under 3/4
+        if ((shard.used + 1) * 4 > shard.slots.size() * 3) {
+            if (shard.slots.size() >= MAX_CAPACITY) {
+                size_t mask = shard.slots.size() - 1;
+                for (size_t i = h & mask; shard.slots[i].ino != 0; i = (i + 1) & mask) {
+                    if (shard.slots[i].ino == ino && shard.slots[i].dev == dev) {
+                        return false;
+                    }
+                }
+                return true; // full: count it rather than grow past the bound
+            }
+            grow(shard, shard.slots.size() * 2);
+        }
+        if (!place(shard.slots, Entry{dev, ino}, h)) {
+            return false;
+        }
+        shard.used++;
+        return true;
+    }
+};
+
+/**
+ * Optional on-disk cache of du results, enabled by setting SMASH_DU_CACHE.
+ * For every scanned directory it keeps the directory's (st_dev, st_ino), mtime and ctime,
+ * the bytes of its non-directory entries, its hard-linked files and the names of its
+ * subdirectories. While the directory's mtime and ctime are unchanged its entries were not
+ * added, removed or renamed, so a warm run only opens and fstats each directory instead of
+ * listing it and stat-ing every file. Like any mtime-keyed cache it does not see files that
+ * grow in place.
+ *
+ * The file ($XDG_CACHE_HOME/smash/du.cache) is memory-mapped and indexed on load, records
+ * are decoded only when they are hit. It is rewritten through a temporary file and rename:
+ * first the records of the last run, then the old records of directories that run did not
+ * visit, in their previous order. Records that have gone unvisited the longest therefore sit
+ * at the end and are the ones dropped once the file reaches MAX_FILE_SIZE, which is what
+ * eventually removes deleted directories.
+ */
+class DuCache {
+public:
+    struct Key {
+        unsigned long long dev;
+        unsigned long long ino;
+        bool operator==(const Key& other) const {
+            return dev == other.dev && ino == other.ino;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<unsigned long long>()(key.ino * 0x9E3779B97F4A7C15ULL ^ key.dev);
+        }
+    };
+
+    struct LinkedFile {
+        unsigned long long dev;
+        unsigned long long ino;
+        unsigned long long bytes;
+    };
+
+    typedef std::pair<const char *, size_t> Name;
+
+private:
+    // record layout: HEADER_WORDS 64-bit words, linked files (3 words each),
+    // then the subdirectory names as a 32-bit length followed by the bytes
+    enum {
+        REC_SIZE, REC_DEV, REC_INO, REC_MTIME_SEC, REC_MTIME_NSEC, REC_CTIME_SEC, REC_CTIME_NSEC,
+        REC_BYTES, REC_COUNTS, HEADER_WORDS
+    };
+    static constexpr const char *MAGIC = "SMDUC001";
+    static const size_t MAGIC_SIZE = 8;
+    static const size_t MAX_FILE_SIZE = 64 << 20;
+
+    const unsigned char *map = nullptr;
+    size_t map_size = 0;
+    std::unordered_map<Key, size_t, KeyHash> index; // record offsets in map
+
+    static unsigned long long word(const unsigned char *rec, int i) {
+        unsigned long long value;
+        memcpy(&value, rec + i * sizeof(value), sizeof(value));
+        return value;
+    }
+
+    // true if the linked files and subdirectory names the header announces fit in size bytes
+    static bool fits(const unsigned char *rec, unsigned long long size) {
+        unsigned long long counts = word(rec, REC_COUNTS);
+        unsigned long long subdir_count = counts & 0xffffffffULL;
+        unsigned long long linked_count = counts >> 32;
+        unsigned long long used = HEADER_WORDS * 8 + linked_count * 24;
+        if (used > size) {
+            return false;
+        }
+        for (unsigned long long i = 0; i < subdir_count; ++i) {
+            uint32_t len;
+            if (size - used < sizeof(len)) {
+                return false;
+            }
+            memcpy(&len, rec + used, sizeof(len));
+            used += sizeof(len);
+            if (size - used < len) {
+                return false;
+            }
+            used += len;
+        }
+        return used == size;
+    }
+
+    static void putWord(std::string& out, unsigned long long value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static std::string directory() {
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        if (xdg && xdg[0] == '/') {
+            return std::string(xdg) + "/smash";
+        }
+        const char *home = getenv("HOME");
+        if (!home || !home[0]) {
+            return "";
+        }
+        return std::string(home) + "/.cache/smash";
+    }
+
+public:
+    DuCache() = default;
+    DuCache(DuCache const &) = delete;
+    void operator=(DuCache const &) = delete;
+
+    ~DuCache() {
+        if (map) {
+            munmap(const_cast<unsigned char *>(map), map_size);
+        }
+    }
+
+    static bool enabled() {
+        const char *env = getenv("SMASH_DU_CACHE");
+        return env && env[0] && strcmp(env, "0") != 0;
+    }
+
+    void load() {
+        std::string dir = directory();
+        if (dir.empty()) {
+            return;
+        }
+        int fd = open((dir + "/du.cache").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return; // cold cache
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size > (off_t)MAGIC_SIZE) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                map = static_cast<const unsigned char *>(p);
+                map_size = st.st_size;
+            }
+        }
+        close(fd);
+        if (!map || memcmp(map, MAGIC, MAGIC_SIZE) != 0) {
+            return;
+        }
+        for (size_t off = MAGIC_SIZE; off < map_size;) {
+            unsigned long long size = map_size - off < HEADER_WORDS * 8 ? 0 : word(map + off, REC_SIZE);
+            if (size < HEADER_WORDS * 8 || size > map_size - off || !fits(map + off, size)) {
+                index.clear(); // truncated or corrupt: start over with a cold cache
+                return;
+            }
+            index[Key{word(map + off, REC_DEV), word(map + off, REC_INO)}] = off;
+            off += size;
+        }
+    }
+
+    // the record of a directory whose mtime and ctime still match st, or nullptr
+    const unsigned char *find(const struct stat& st) const {
+        auto it = index.find(Key{(unsigned long long)st.st_dev, (unsigned long long)st.st_ino});
+        if (it == index.end()) {
+            return nullptr;
+        }
+        const unsigned char *rec = map + it->second;
+        if (word(rec, REC_MTIME_SEC) != (unsigned long long)st.st_mtim.tv_sec ||
+            word(rec, REC_MTIME_NSEC) != (unsigned long long)st.st_mtim.tv_nsec ||
+            word(rec, REC_CTIME_SEC) != (unsigned long long)st.st_ctim.tv_sec ||
+            word(rec, REC_CTIME_NSEC) != (unsigned long long)st.st_ctim.tv_nsec) {
+            return nullptr;
+        }
+        return rec;
+    }
+
+    static unsigned long long recordBytes(const unsigned char *rec) {
+        return word(rec, REC_BYTES);
+    }
+
+    static void decode(const unsigned char *rec, std::vector<LinkedFile>& linked,
+                       std::vector<Name>& subdirs) {
+        unsigned long long counts = word(rec, REC_COUNTS);
+        size_t subdir_count = counts & 0xffffffffULL;
+        size_t linked_count = counts >> 32;
+        int w = HEADER_WORDS;
+        for (size_t i = 0; i < linked_count; ++i, w += 3) {
+            linked.push_back(LinkedFile{word(rec, w), word(rec, w + 1), word(rec, w + 2)});
+        }
+        const unsigned char *p = rec + w * 8;
+        for (size_t i = 0; i < subdir_count; ++i) {
+            uint32_t len;
+            memcpy(&len, p, sizeof(len));
+            subdirs.push_back(Name(reinterpret_cast<const char *>(p + sizeof(len)), len));
+            p += sizeof(len) + len;
+        }
+    }
+
+    static void appendRaw(std::string& out, const unsigned char *rec) {
+        out.append(reinterpret_cast<const char *>(rec), word(rec, REC_SIZE));
+    }
+
+    static void append(std::string& out, const struct stat& st, unsigned long long bytes,
+                       const std::vector<LinkedFile>& linked, const std::vector<Name>& subdirs) {
+        size_t start = out.size();
+        putWord(out, 0); // size, patched below
+        putWord(out, st.st_dev);
+        putWord(out, st.st_ino);
+        putWord(out, st.st_mtim.tv_sec);
+        putWord(out, st.st_mtim.tv_nsec);
+        putWord(out, st.st_ctim.tv_sec);
+        putWord(out, st.st_ctim.tv_nsec);
+        putWord(out, bytes);
+        putWord(out, subdirs.size() | ((unsigned long long)linked.size() << 32));
+        for (const auto& file : linked) {
+            putWord(out, file.dev);
+            putWord(out, file.ino);
+            putWord(out, file.bytes);
+        }
+        for (const auto& name : subdirs) {
+            uint32_t len = name.second;
+            out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+            out.append(name.first, len);
+        }
+        unsigned long long size = out.size() - start;
+        memcpy(&out[start], &size, sizeof(size));
+    }
+
+    /**
+     * Writes the records produced by this run, followed by the previously cached records of
+     * directories this run did not visit, until the file would exceed MAX_FILE_SIZE.
+     */
+    void save(const std::vector<const std::string *>& fresh,
+              const std::unordered_set<Key, KeyHash>& visited) const {
+        std::string dir = directory();
+        if (dir.empty()) {
+            return;
+        }
+        mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+        mkdir(dir.c_str(), 0700);
+        std::string path = dir + "/du.cache";
+        std::string tmp = path + ".tmp." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            return;
+        }
+        bool ok = write(fd, MAGIC, MAGIC_SIZE) == (ssize_t)MAGIC_SIZE;
+        size_t total = MAGIC_SIZE;
+        for (const std::string *chunk : fresh) {
+            ok = ok && write(fd, chunk->data(), chunk->size()) == (ssize_t)chunk->size();
+            total += chunk->size();
+        }
+        // keep the file order of the old records so the least recently visited come last
+        std::vector<size_t> offsets;
+        for (const auto& entry : index) {
+            if (!visited.count(entry.first)) {
+                offsets.push_back(entry.second);
+            }
+        }
+        std::sort(offsets.begin(), offsets.end());
+        std::string old;
+        for (size_t off : offsets) {
+            const unsigned char *rec = map + off;
+            unsigned long long size = word(rec, REC_SIZE);
+            if (size > map_size - off || !fits(rec, size)) {
+                continue;
+            }
+            if (total + old.size() + size > MAX_FILE_SIZE) {
+                break;
+            }
+            appendRaw(old, rec);
+        }
+        ok = ok && write(fd, old.data(), old.size()) == (ssize_t)old.size();
+        close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) == -1) {
+            unlink(tmp.c_str());
+        }
+    }
+};
+
+/**
+ * Multi-threaded disk usage traversal.
+ * Every worker owns a deque of directories still to be scanned: it pushes and pops at the
+ * back (depth first, which keeps few directory fds open) and idle workers steal from the
+ * front of the others. Directories are opened with openat relative to their parent's fd and
+ * entries are examined with du_stat, so no full paths are ever built. Each worker sums its
+ * own bytes and the totals are merged once at the end. Files with several hard links are
+ * counted once, through an InodeSet shared by all workers.
+ * With a DuCache, unchanged directories are taken from the cache instead of being listed;
+ * each directory then counts its own blocks from an fstat of its fd, which also gives the
+ * cache key.
+ */
+class DiskUsageWalker {
+private:
+    // an open directory, kept alive while subdirectories relative to it are queued
+    struct Dir {
+        int fd;
+        std::atomic<int> refs;
+        explicit Dir(int fd) : fd(fd), refs(1) {}
+    };
+
+    struct Task {
+        Dir *parent;
+        std::string name;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        unsigned long long bytes = 0;
+        std::vector<DirEntry> entries; // scratch buffer for directory listings
+        // cache records written by this worker, and scratch buffers to build or decode them
+        std::string records;
+        std::vector<DuCache::Key> visited;
+        std::vector<DuCache::LinkedFile> linked;
+        std::vector<DuCache::Name> subdirs;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::atomic<long> pending; // tasks queued or being scanned
+    std::atomic<long> queued; // tasks waiting in some worker's deque
+    // workers without work sleep on wake until a task is queued or pending drops to 0
+    std::atomic<int> idle;
+    std::mutex idle_lock;
+    std::condition_variable wake;
+    InodeSet linked_inodes;
+    DuCache *cache;
+    time_t start_time;
+
+    // false for the second and later links to the same file
+    bool countOnce(const DuStat& st) {
+        return S_ISDIR(st.mode) || st.nlink <= 1 || linked_inodes.insert(st.dev, st.ino);
+    }
+
+    static void release(Dir *dir) {
+        if (dir && dir->refs.fetch_sub(1) == 1) {
+            close(dir->fd);
+            delete dir;
+        }
+    }
+
+    void wakeIdle(bool all) {
+        if (idle.load() == 0) {
+            return; // a worker going idle checks queued/pending after announcing itself
+        }
+        std::lock_guard<std::mutex> guard(idle_lock);
+        if (all) {
+            wake.notify_all();
+        }
+        else {
+            wake.notify_one();
+        }
+    }
+
+    void push(Worker& self, Dir *parent, const char *name) {
+        parent->refs.fetch_add(1);
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(self.lock);
+            self.tasks.push_back(Task{parent, name});
+        }
+        queued.fetch_add(1);
+        wakeIdle(false);
+    }
+
+    bool pop(size_t self, Task& task) {
+        {
+            Worker& own = *workers[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); ++i) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool cacheHit(Worker& self, Dir *dir, const struct stat& dir_st) {
+        const unsigned char *rec = cache->find(dir_st);
+        if (!rec) {
+            return false;
+        }
+        self.bytes += DuCache::recordBytes(rec);
+        self.linked.clear();
+        self.subdirs.clear();
+        DuCache::decode(rec, self.linked, self.subdirs);
+        for (const auto& file : self.linked) {
+            if (linked_inodes.insert(file.dev, file.ino)) {
+                self.bytes += file.bytes;
+            }
+        }
+        for (const auto& name : self.subdirs) {
+            push(self, dir, std::string(name.first, name.second).c_str());
+        }
+        DuCache::appendRaw(self.records, rec);
+        return true;
+    }
+
+    /**
+     * Counts the entries of an open directory and queues its subdirectories, false if it
+     * could not be listed.
+     * With a cache, dir_st is the directory's own stat: a matching record replaces the
+     * listing, otherwise a new record is written (unless the directory changed so recently
+     * that a later change could keep the same timestamp).
+     */
+    bool scanDir(Worker& self, Dir *dir, const struct stat *dir_st) {
+        if (dir_st) {
+            // replaces any old record of this directory, whether or not a new one is written
+            self.visited.push_back(DuCache::Key{(unsigned long long)dir_st->st_dev,
+                                                (unsigned long long)dir_st->st_ino});
+            if (cacheHit(self, dir, *dir_st)) {
+                return true;
+            }
+        }
+        self.entries.clear();
+        if (!list_dir_fd(dir->fd, self.entries)) {
+            perror("smash error: open failed");
+            return false;
+        }
+        bool complete = true;
+        unsigned long long dir_bytes = 0;
+        self.linked.clear();
+        self.subdirs.clear();
+        for (const auto& entry : self.entries) {
+            // Do NOT follow symlinks – ignore them entirely, d_type tells us without a stat
+            if (entry.type == DT_LNK) {
+                continue;
+            }
+            DuStat st{};
+            if (du_stat(dir->fd, entry.name.c_str(), st) == -1) {
+                perror("smash error: lstat failed");
+                complete = false;
+                continue;
+            }
+            if (S_ISLNK(st.mode)) {
+                continue;
+            }
+            if (S_ISDIR(st.mode)) {
+                if (!cache) {
+                    self.bytes += st.blocks * 512ULL;
+                }
+                self.subdirs.push_back(DuCache::Name(entry.name.c_str(), entry.name.size()));
+                push(self, dir, entry.name.c_str());
+                continue;
+            }
+            if (st.nlink > 1) {
+                self.linked.push_back(DuCache::LinkedFile{st.dev, st.ino, st.blocks * 512ULL});
+            }
+            else {
+                dir_bytes += st.blocks * 512ULL;
+            }
+            if (!countOnce(st)) {
+                continue;
+            }
+            // Count disk usage using st_blocks (512-byte units)
+            self.bytes += st.blocks * 512ULL;
+        }
+        if (dir_st && complete &&
+            dir_st->st_mtime < start_time - 1 && dir_st->st_ctime < start_time - 1) {
+            DuCache::append(self.records, *dir_st, dir_bytes, self.linked, self.subdirs);
+        }
+        return true;
+    }
+
+    void scan(Worker& self, Task& task) {
+        int fd = openat(task.parent->fd, task.name.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            int open_errno = errno;
+            DuStat st{};
+            if (cache && du_stat(task.parent->fd, task.name.c_str(), st) == 0) {
+                self.bytes += st.blocks * 512ULL; // still counted, like without a cache
+            }
+            release(task.parent);
+            errno = open_errno;
+            perror("smash error: open failed");
+            return;
+        }
+        release(task.parent);
+        Dir *dir = new Dir(fd);
+        struct stat dir_st{};
+        if (cache && fstat(fd, &dir_st) == 0) {
+            self.bytes += static_cast<unsigned long long>(dir_st.st_blocks) * 512ULL;
+            scanDir(self, dir, &dir_st);
+        }
+        else {
+            scanDir(self, dir, nullptr);
+        }
+        release(dir);
+    }
+
+    void work(size_t self) {
+        Task task;
+        for (;;) {
+            if (pop(self, task)) {
+                scan(*workers[self], task);
+                if (pending.fetch_sub(1) == 1) {
+                    wakeIdle(true); // the walk is over
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_lock);
+            idle.fetch_add(1);
+            wake.wait(lock, [this] { return queued.load() > 0 || pending.load() == 0; });
+            idle.fetch_sub(1);
+            if (pending.load() == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit DiskUsageWalker(unsigned int thread_count, DuCache *cache = nullptr)
+        : pending(0), queued(0), idle(0), cache(cache), start_time(time(nullptr)) {
+        for (unsigned int i = 0; i < std::max(thread_count, 1U); ++i) {
+            workers.emplace_back(new Worker());
+        }
+    }
+
+    // SMASH_DU_THREADS overrides the default of one thread per CPU (at most 8)
+    static unsigned int defaultThreadCount() {
+        const char *env = getenv("SMASH_DU_THREADS");
+        if (env) {
+            long n = strtol(env, nullptr, 10);
+            if (n > 0) {
+                return static_cast<unsigned int>(std::min(n, 256L));
+            }
+        }
+        return std::max(1U, std::min(std::thread::hardware_concurrency(), 8U));
+    }
+
+    /**
+     * Adds the disk usage of path (not following symlinks) to total_bytes.
+     * Returns -1 after printing an error if path itself cannot be examined.
+     */
+    int run(const std::string& path, unsigned long long& total_bytes) {
+        DuStat st{};
+        if (du_stat(AT_FDCWD, path.c_str(), st) == -1) {
+            perror("smash error: lstat failed");
+            return -1;
+        }
+        if (S_ISLNK(st.mode) || !countOnce(st)) {
+            return 0;
+        }
+        total_bytes += st.blocks * 512ULL;
+        if (!S_ISDIR(st.mode)) {
+            return 0;
+        }
+
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("smash error: open failed");
+            return -1;
+        }
+        Dir *root = new Dir(fd);
+        struct stat root_st{};
+        bool keyed = cache && fstat(fd, &root_st) == 0;
+        // seeds the first worker, the others steal from it
+        if (!scanDir(*workers[0], root, keyed ? &root_st : nullptr)) {
+            release(root);
+            return -1;
+        }
+        release(root);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers.size(); ++i) {
+            threads.emplace_back(&DiskUsageWalker::work, this, i);
+        }
+        work(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        std::vector<const std::string *> records;
+        std::unordered_set<DuCache::Key, DuCache::KeyHash> visited;
+        for (const auto& worker : workers) {
+            total_bytes += worker->bytes;
+            records.push_back(&worker->records);
+            visited.insert(worker->visited.begin(), worker->visited.end());
+        }
+        if (cache) {
+            cache->save(records, visited);
+        }
+        return 0;
+    }
+};
+
+/**
+ * Copies in_fd to out_fd until EOF without passing the data through user space when the
+ * kernel allows it: copy_file_range between files, splice when one side is a pipe,
+ * and a plain read/write loop otherwise.
+ */
+static bool copy_fd(int in_fd, int out_fd) {
+    bool try_copy_range = true;
+    bool try_splice = true;
+    std::vector<char> buf;
+    for (;;) {
+        ssize_t n;
+        if (try_copy_range) {
+            n = copy_file_range(in_fd, nullptr, out_fd, nullptr, 1 << 30, 0);
+            if (n == -1 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                            errno == EBADF || errno == EOPNOTSUPP)) {
+                try_copy_range = false; // not two regular files, or out_fd is O_APPEND
+                continue;
+            }
+        }
+        else if (try_splice) {
+            n = splice(in_fd, nullptr, out_fd, nullptr, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                try_splice = false; // neither side is a pipe
+                continue;
+            }
+        }
+        else {
+            if (buf.empty()) {
+                buf.resize(1 << 16);
+            }
+            n = read(in_fd, buf.data(), buf.size());
+            for (ssize_t off = 0; n > 0 && off < n;) {
+                ssize_t w = write(out_fd, buf.data() + off, n - off);
+                if (w == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                off += w;
+            }
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+    }
+}
+
+/**
+ * Recognizes "cat file..." with only regular file operands, so smash can forward the files
+ * itself. On success the opened (O_CLOEXEC) operands are returned in fds. Anything else -
+ * options, stdin, missing files, or a file that is also out_fd - returns false and is left
+ * to the real cat, which reports its own errors.
+ */
+static bool open_cat_operands(const CommandArgs& args, std::vector<int>& fds, int out_fd = -1) {
+    if (args.size() < 2 || strcmp(args[0], "cat") != 0) {
+        return false;
+    }
+    struct stat out_st{};
+    bool has_out = out_fd != -1 && fstat(out_fd, &out_st) == 0;
+    for (int i = 1; i < args.size(); ++i) {
+        struct stat st{};
+        int fd = -1;
+        if (args[i][0] != '-') {
+            fd = open(args[i], O_RDONLY | O_CLOEXEC);
+        }
+        if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            (has_out && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            for (int opened : fds) {
+                close(opened);
+            }
+            fds.clear();
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    return true;
+}
+
+enum SpawnBackend {
+    SPAWN_POSIX, // posix_spawnp, which glibc implements with clone(CLONE_VM | CLONE_VFORK)
+    SPAWN_FORK   // plain fork + execvp
+};
+
+// SMASH_SPAWN=fork selects the fork backend, e.g. to compare the two
+static SpawnBackend spawn_backend() {
+    static const char *env = getenv("SMASH_SPAWN");
+    static SpawnBackend backend = (env && strcmp(env, "fork") == 0) ? SPAWN_FORK : SPAWN_POSIX;
+    return backend;
+}
+
+// path, if not null, is the already resolved executable; PATH is searched when exec'ing it fails
+static pid_t fork_process(char *const argv[], pid_t pgid,
+                          const std::vector<std::pair<int, int> >& dups, const char *path) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("smash error: fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, pgid);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr); // smash blocks the signals it reads from a signalfd
+        for (const auto& dup : dups) {
+            if (dup2(dup.first, dup.second) == -1) {
+                perror("smash error: dup2 failed");
+                exit(1);
+            }
+        }
+        if (path != nullptr) {
+            execv(path, argv);
+        }
+        execvp(argv[0], argv);
+        perror("smash error: execvp failed");
+        exit(1);
+    }
+    // also here, so the group exists before the caller spawns into it or waits on it; once the
+    // child has exec'd this fails with EACCES, but then the child already did it itself
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+// the fds a spawned child gets as stdout/stderr, moved by OutputRedirect
+static int spawn_stdout = STDOUT_FILENO;
+static int spawn_stderr = STDERR_FILENO;
+
+// a write-only streambuf on a file descriptor; write errors (EPIPE) drop the output
+class FdOutputBuf : public std::streambuf {
+private:
+    int fd;
+    char buffer[8192];
+
+    bool flushBuffer() {
+        const char *p = pbase();
+        size_t left = pptr() - pbase();
+        setp(buffer, buffer + sizeof(buffer));
+        while (left > 0) {
+            ssize_t n = write(fd, p, left);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        return true;
+    }
+protected:
+    int overflow(int c) override {
+        if (!flushBuffer()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        return flushBuffer() ? 0 : -1;
+    }
+public:
+    explicit FdOutputBuf(int fd): fd(fd) {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+};
+
+/**
+ * While alive, std::cout (target STDOUT_FILENO) or std::cerr (STDERR_FILENO) writes into fd,
+ * and children spawned meanwhile get fd as that descriptor. This is how built-ins write
+ * into redirections and pipes without the shell's own fd 1 being touched.
+ */
+class OutputRedirect {
+private:
+    std::ostream &stream;
+    int &spawn_fd;
+    int saved_spawn_fd;
+    FdOutputBuf buf;
+    std::streambuf *saved_buf;
+public:
+    OutputRedirect(int target, int fd): stream(target == STDERR_FILENO ? std::cerr : std::cout),
+                                        spawn_fd(target == STDERR_FILENO ? spawn_stderr : spawn_stdout),
+                                        saved_spawn_fd(spawn_fd), buf(fd) {
+        stream.flush();
+        saved_buf = stream.rdbuf(&buf);
+        spawn_fd = fd;
+    }
+
+    ~OutputRedirect() {
+        stream.flush();
+        stream.rdbuf(saved_buf);
+        spawn_fd = saved_spawn_fd;
+    }
+
+    OutputRedirect(OutputRedirect const &) = delete;
+    void operator=(OutputRedirect const &) = delete;
+};
+
+/**
+ * Starts argv[0] (searched in PATH) in the process group pgid (0 = a new group led by the child).
+ * dups are (fd, target) pairs applied with dup2 in the child; stdout/stderr not listed there
+ * follow the active OutputRedirect. Other descriptors the child must not inherit are expected
+ * to be O_CLOEXEC.
+ * Returns the child pid, or -1 after printing an error.
+ */
+static pid_t spawn_process(char *const argv[], pid_t pgid = 0,
+                           std::vector<std::pair<int, int> > dups = std::vector<std::pair<int, int> >()) {
+    PhaseTimer timer(PHASE_SPAWN);
+    std::cout.flush(); // the child writes to the same fds, keep the output in order
+    bool has_stdout = false;
+    bool has_stderr = false;
+    for (const auto &dup : dups) {
+        has_stdout = has_stdout || dup.second == STDOUT_FILENO;
+        has_stderr = has_stderr || dup.second == STDERR_FILENO;
+    }
+    if (!has_stdout && spawn_stdout != STDOUT_FILENO) {
+        dups.insert(dups.begin(), std::make_pair(spawn_stdout, static_cast<int>(STDOUT_FILENO)));
+    }
+    if (!has_stderr && spawn_stderr != STDERR_FILENO) {
+        dups.insert(dups.begin(), std::make_pair(spawn_stderr, static_cast<int>(STDERR_FILENO)));
+    }
+    PathCache &path_cache = SmallShell::getInstance().getPathCache();
+    std::string resolved;
+    const char *path = path_cache.resolve(argv[0], resolved) ? resolved.c_str() : nullptr;
+    if (spawn_backend() == SPAWN_FORK) {
+        return fork_process(argv, pgid, dups, path);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return fork_process(argv, pgid, dups, path);
+    }
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return fork_process(argv, pgid, dups, path);
+    }
+
+    // smash blocks the signals it reads from a signalfd, the child starts with none blocked
+    sigset_t none;
+    sigemptyset(&none);
+    int err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                              POSIX_SPAWN_USEVFORK);
+    if (err == 0) {
+        err = posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    if (err == 0) {
+        err = posix_spawnattr_setsigmask(&attr, &none);
+    }
+    for (size_t i = 0; err == 0 && i < dups.size(); ++i) {
+        err = posix_spawn_file_actions_adddup2(&actions, dups[i].first, dups[i].second);
+    }
+
+    pid_t pid = -1;
+    if (err == 0 && path != nullptr) {
+        err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        if (err != 0 && err != EAGAIN && err != ENOMEM && err != ENOSYS && err != EINVAL && err != ENOEXEC) {
+            // the remembered file is gone or cannot be run any more: search PATH again
+            path_cache.forget(argv[0]);
+            path = nullptr;
+            err = 0;
+        }
+    }
+    if (err == 0 && path == nullptr) {
+        err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err == ENOSYS || err == EINVAL || err == ENOEXEC) {
+        // spawn attributes not supported here, or a script without a #! line that only
+        // execvp hands to /bin/sh: fall back to fork
+        return fork_process(argv, pgid, dups, path);
+    }
+    if (err != 0) {
+        errno = err;
+        if (err == EAGAIN || err == ENOMEM) {
+            perror("smash error: fork failed");
+        }
+        else {
+            perror("smash error: execvp failed");
+        }
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Fixed size slots for Command objects. A command lives for one line (two when a
+ * redirection runs its inner command), so the same few slots are handed out again and
+ * again and a long session does not touch malloc for them. Anything larger than a slot
+ * goes to the global heap.
+ */
+class CommandPool {
+private:
+    static const size_t SLOT_SIZE = 256;
+    struct Slot {
+        alignas(std::max_align_t) unsigned char bytes[SLOT_SIZE];
+    };
+    std::deque<Slot> slots; // grows at the end only, so slots never move
+    std::vector<void *> free_slots;
+public:
+    static CommandPool& instance() {
+        static CommandPool pool;
+        return pool;
+    }
+
+    void *allocate(size_t size) {
+        if (size > SLOT_SIZE) {
+            return ::operator new(size);
+        }
+        if (free_slots.empty()) {
+            slots.emplace_back();
+            return slots.back().bytes;
+        }
+        void *p = free_slots.back();
+        free_slots.pop_back();
+        return p;
+    }
+
+    void deallocate(void *p, size_t size) {
+        if (p == nullptr) {
+            return;
+        }
+        if (size > SLOT_SIZE) {
+            ::operator delete(p);
+            return;
+        }
+        free_slots.push_back(p);
+    }
+};
+
+#ifndef USB_DEVICES_DIR
+#define USB_DEVICES_DIR "/sys/bus/usb/devices"
+#endif
+
+struct UsbDeviceInfo {
+    int devnum;
+    std::string vendor;
+    std::string product;
+    std::string manufacturer;
+    std::string product_name;
+    std::string max_power; // just the number or "N/A"
+};
+
+// the sysfs attributes usbinfo shows, devnum first
+static const char *const USB_ATTRIBUTES[] = {"devnum", "idVendor", "idProduct", "manufacturer",
+                                             "product", "bMaxPower", "power/max_power"};
+static const size_t USB_ATTRIBUTE_COUNT = sizeof(USB_ATTRIBUTES) / sizeof(USB_ATTRIBUTES[0]);
+
+// the devnum of a device directory, 0 if it is not a real USB device
+static int parse_devnum(const std::string& devnum_str) {
+    char* endptr = nullptr;
+    long devnum = strtol(devnum_str.c_str(), &endptr, 10);
+    if (endptr == devnum_str.c_str() || devnum <= 0) {
+        return 0; // malformed devnum
+    }
+    return (int)devnum;
 }
 
+// fills info from the first lines of USB_ATTRIBUTES[1..] (empty when missing)
+static void parse_usb_device(int devnum, const std::string *attrs, UsbDeviceInfo& info) {
+    info.devnum = devnum;
+    info.vendor = attrs[1].empty() ? "N/A" : attrs[1];
+    info.product = attrs[2].empty() ? "N/A" : attrs[2];
+    info.manufacturer = attrs[3].empty() ? "N/A" : attrs[3];
+    info.product_name = attrs[4].empty() ? "N/A" : attrs[4];
+
+    // Max power: try bMaxPower, then power/max_power
+    const std::string& mp = attrs[5].empty() ? attrs[6] : attrs[5];
+
+    // Extract digits only, we'll add "mA" on print
+    std::string digits;
+    for (char c : mp) {
+        if (isdigit((unsigned char)c)) {
+            digits.push_back(c);
+        }
+    }
+    info.max_power = digits.empty() ? "N/A" : digits;
+}
 
-static bool read_first_line(const std::string& path, std::string& out) {
-    int fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1) {
+// reads the device directory name under base_fd; false if it is not a real device (no devnum)
+static bool read_usb_device(int base_fd, const char *name, UsbDeviceInfo& info) {
+    int dir_fd = openat(base_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
         return false;
     }
 
-    char buf[256];
-    ssize_t n = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-
-    if (n <= 0) {
+    // devnum tells us it's a "real" USB device
+    std::string attrs[USB_ATTRIBUTE_COUNT];
+    int devnum = 0;
+    if (read_first_line_at(dir_fd, USB_ATTRIBUTES[0], attrs[0])) {
+        devnum = parse_devnum(attrs[0]);
+    }
+    if (devnum == 0) {
+        close(dir_fd);
         return false;
     }
-
-    buf[n] = '\0';
-    std::string s(buf);
-
-    // cut at newline
-    size_t pos = s.find_first_of("\r\n");
-    if (pos != std::string::npos) {
-        s = s.substr(0, pos);
+    for (size_t a = 1; a < USB_ATTRIBUTE_COUNT; ++a) {
+        if (a == 6 && !attrs[5].empty()) {
+            break; // power/max_power is only the fallback of bMaxPower
+        }
+        read_first_line_at(dir_fd, USB_ATTRIBUTES[a], attrs[a]);
     }
-
-    out = _trim(s);
-    return !out.empty();
+    close(dir_fd);
+    parse_usb_device(devnum, attrs, info);
+    return true;
 }
 
+/**
+ * The device table printed by usbinfo. sysfs only has to be scanned again after a
+ * device came or went: a NETLINK_KOBJECT_UEVENT socket opened before the first scan
+ * queues every kernel uevent, and the table is dropped once a usb one was seen. Where
+ * the socket cannot be opened every call scans.
+ */
+class UsbDeviceTable {
+private:
+    int uevent_fd = -1;
+    bool valid = false;
+    std::vector<UsbDeviceInfo> devices;
 
-static bool list_dir_entries(const std::string& path,
-                             std::vector<std::string>& names) {
-    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
-    if (fd == -1) {
-        return false;
+    UsbDeviceTable() {
+        uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (uevent_fd == -1) {
+            return;
+        }
+        struct sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1; // kernel uevents
+        if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(uevent_fd);
+            uevent_fd = -1;
+        }
     }
 
-    struct linux_dirent64 {
-        ino64_t        d_ino;
-        off64_t        d_off;
-        unsigned short d_reclen;
-        unsigned char  d_type;
-        char           d_name[];
-    };
+    // reads every queued uevent, true if the table may be stale
+    bool drainUevents() {
+        bool changed = false;
+        char buf[8192];
+        for (;;) {
+            ssize_t n = recv(uevent_fd, buf, sizeof(buf), 0);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // ENOBUFS: events were dropped, so anything may have changed
+                return changed || errno != EAGAIN;
+            }
+            if (memmem(buf, n, "SUBSYSTEM=usb", sizeof("SUBSYSTEM=usb")) != nullptr) {
+                changed = true; // matches the NUL ending the key, so not usb_power_delivery etc.
+            }
+        }
+    }
 
-    const int BUF_SIZE = 4096;
-    char buf[BUF_SIZE];
+    // batches through the io_uring reader, relative to an O_PATH fd of each device
+    // directory: every devnum, then the attributes of the devices, then power/max_power
+    // where bMaxPower is missing
+    static void scanBatched(int base_fd, const std::vector<DirEntry>& entries,
+                            std::vector<UsbDeviceInfo>& found, std::vector<char>& is_device) {
+        std::vector<int> dir_fds(entries.size(), -1);
+        std::vector<BatchFileReader::Request> requests;
+        std::vector<size_t> candidates;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            dir_fds[i] = openat(base_fd, entries[i].name.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fds[i] != -1) {
+                requests.emplace_back(dir_fds[i], USB_ATTRIBUTES[0], 256);
+                candidates.push_back(i);
+            }
+        }
+        BatchFileReader::instance().read(requests);
+        std::vector<size_t> devices;
+        std::vector<int> devnums(entries.size(), 0);
+        for (size_t k = 0; k < candidates.size(); ++k) {
+            std::string devnum_str;
+            size_t i = candidates[k];
+            if (first_line(requests[k].data.c_str(), devnum_str)) {
+                devnums[i] = parse_devnum(devnum_str);
+            }
+            if (devnums[i] != 0) {
+                devices.push_back(i);
+            }
+        }
 
-    for (;;) {
-        int nread = syscall(SYS_getdents64, fd, buf, BUF_SIZE);
-        if (nread == -1) {
-            close(fd);
-            return false;
+        const size_t PER_DEVICE = USB_ATTRIBUTE_COUNT - 2; // devnum done, power/max_power only if needed
+        requests.clear();
+        for (size_t i : devices) {
+            for (size_t a = 1; a <= PER_DEVICE; ++a) {
+                requests.emplace_back(dir_fds[i], USB_ATTRIBUTES[a], 256);
+            }
         }
-        if (nread == 0) {
-            break; // EOF
+        BatchFileReader::instance().read(requests);
+        std::vector<std::vector<std::string> > attrs(devices.size(), std::vector<std::string>(USB_ATTRIBUTE_COUNT));
+        std::vector<size_t> no_max_power;
+        for (size_t d = 0; d < devices.size(); ++d) {
+            for (size_t a = 1; a <= PER_DEVICE; ++a) {
+                first_line(requests[d * PER_DEVICE + a - 1].data.c_str(), attrs[d][a]);
+            }
+            if (attrs[d][5].empty()) {
+                no_max_power.push_back(d);
+            }
         }
 
-        int bpos = 0;
-        while (bpos < nread) {
-            struct linux_dirent64* d =
-                (struct linux_dirent64*)(buf + bpos);
-            std::string name = d->d_name;
+        requests.clear();
+        for (size_t d : no_max_power) {
+            requests.emplace_back(dir_fds[devices[d]], USB_ATTRIBUTES[6], 256);
+        }
+        BatchFileReader::instance().read(requests);
+        for (size_t k = 0; k < no_max_power.size(); ++k) {
+            first_line(requests[k].data.c_str(), attrs[no_max_power[k]][6]);
+        }
 
-            if (name != "." && name != "..") {
-                names.push_back(name);
+        for (size_t d = 0; d < devices.size(); ++d) {
+            parse_usb_device(devnums[devices[d]], attrs[d].data(), found[devices[d]]);
+            is_device[devices[d]] = 1;
+        }
+        for (int fd : dir_fds) {
+            if (fd != -1) {
+                close(fd);
             }
-            bpos += d->d_reclen;
         }
     }
 
-    close(fd);
-    return true;
-}
-
-static int du_recursive(const std::string& path, unsigned long long& total_bytes) {
-    struct stat st{};
-    if (lstat(path.c_str(), &st) == -1) {
-        perror("smash error: lstat failed");
-        return -1;
+    // every attribute read is a sysfs round trip, so hubs full of devices are read
+    // by several threads, each claiming the next entry
+    static void scanThreaded(int base_fd, const std::vector<DirEntry>& entries,
+                             std::vector<UsbDeviceInfo>& found, std::vector<char>& is_device) {
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < entries.size(); i = next++) {
+                is_device[i] = read_usb_device(base_fd, entries[i].name.c_str(), found[i]);
+            }
+        };
+        size_t thread_count = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()),
+                                               entries.size() / 16 + 1);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < thread_count; ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &thread : threads) {
+            thread.join();
+        }
     }
 
-    // Do NOT follow symlinks – ignore them entirely
-    if (S_ISLNK(st.st_mode)) {
-        return 0;
-    }
+    bool scan() {
+        int base_fd = open(USB_DEVICES_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (base_fd == -1) {
+            return false;
+        }
+        std::vector<DirEntry> entries;
+        if (!list_dir_fd(base_fd, entries)) {
+            close(base_fd);
+            return false;
+        }
 
-    // Count disk usage using st_blocks (512-byte units)
-    total_bytes += static_cast<unsigned long long>(st.st_blocks) * 512ULL;
+        std::vector<UsbDeviceInfo> found(entries.size());
+        std::vector<char> is_device(entries.size(), 0);
+        if (BatchFileReader::instance().usesRing()) {
+            scanBatched(base_fd, entries, found, is_device);
+        }
+        else {
+            scanThreaded(base_fd, entries, found, is_device);
+        }
+        close(base_fd);
 
-    if (!S_ISDIR(st.st_mode)) {
-        return 0;
+        devices.clear();
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (is_device[i]) {
+                devices.push_back(std::move(found[i]));
+            }
+        }
+        // sort by devnum ascending
+        std::sort(devices.begin(), devices.end(),
+                  [](const UsbDeviceInfo& a, const UsbDeviceInfo& b) {
+                      return a.devnum < b.devnum;
+                  });
+        return true;
+    }
+public:
+    static UsbDeviceTable& instance() {
+        static UsbDeviceTable table;
+        return table;
+    }
+
+    // the current devices, nullptr if the devices directory cannot be read
+    const std::vector<UsbDeviceInfo> *get() {
+        if (uevent_fd == -1 || drainUevents()) {
+            valid = false;
+        }
+        if (!valid) {
+            if (!scan()) {
+                return nullptr;
+            }
+            valid = uevent_fd != -1;
+        }
+        return &devices;
     }
+};
 
-    std::vector<std::string> children;
-    if (!list_dir_entries(path, children)) {
-        perror("smash error: open failed");
-        return -1;
+// the part of a command line after its first `count` words, with the leading whitespace skipped
+static const char *skip_words(const char *cmd_line, int count) {
+    const char *p = cmd_line;
+    for (int i = 0; i <= count; ++i) {
+        while (*p && WHITESPACE.find(*p) != std::string::npos) {
+            p++;
+        }
+        while (i < count && *p && WHITESPACE.find(*p) == std::string::npos) {
+            p++;
+        }
     }
+    return p;
+}
 
-    for (const auto& name : children) {
-        std::string child = path;
-        if (!child.empty() && child.back() != '/') {
-            child += "/";
-        }
-        child += name;
+static long long timespec_ns(const struct timespec &t) {
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-        du_recursive(child, total_bytes); // ignore individual errors
-    }
+static long long timeval_ns(const struct timeval &t) {
+    return t.tv_sec * 1000000000LL + t.tv_usec * 1000LL;
+}
 
-    return 0;
+// "1.234s", rounded down to milliseconds
+static std::string format_seconds(long long ns) {
+    long long ms = ns / 1000000;
+    std::ostringstream out;
+    out << ms / 1000 << '.' << std::setw(3) << std::setfill('0') << ms % 1000 << 's';
+    return out.str();
+}
+
+// "850ns", "12.3us", "4.5ms" or "1.25s"
+static std::string format_duration(unsigned long long ns) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (ns < 1000) {
+        out << ns << "ns";
+    }
+    else if (ns < 1000000) {
+        out << ns / 1e3 << "us";
+    }
+    else if (ns < 1000000000) {
+        out << ns / 1e6 << "ms";
+    }
+    else {
+        out << std::setprecision(2) << ns / 1e9 << "s";
+    }
+    return out.str();
 }
 
 // end of: parsing functions --------------------------------------------------------------------
@@ -214,7 +2125,7 @@ static int du_recursive(const std::string& path, unsigned long long& total_bytes
 
 // start of smallShell class --------------------------------------------------------------------
 
-SmallShell::SmallShell(): prompt("smash"), last_dir("") {
+SmallShell::SmallShell(): prompt("smash"), last_dir(""), parse_cache(1024) {
 
     alias_map = new AliasMap();
     job_list = new JobsList();
@@ -225,80 +2136,337 @@ SmallShell::~SmallShell() {
     delete job_list;
 }
 
-BuiltInCommand::BuiltInCommand(const char *cmd_line): Command(cmd_line) {}
+BuiltInCommand::BuiltInCommand(const ParsedCommandPtr &parsed): Command(parsed) {}
 
-Command::Command(const char *cmd_line): cmd_line(nullptr) {
-    this->cmd_line = strdup(cmd_line);
+Command::Command(const ParsedCommandPtr &parsed): cmd_line(parsed->line.c_str()), args(parsed->args), parsed(parsed) {}
+
+
+template <class T>
+static Command *make_builtin(const ParsedCommandPtr &parsed, JobsList *, AliasMap *) {
+    return new T(parsed);
 }
 
+template <class T>
+static Command *make_jobs_builtin(const ParsedCommandPtr &parsed, JobsList *jobs, AliasMap *) {
+    return new T(parsed, jobs);
+}
 
-/**
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
-*/
-Command *SmallShell::CreateCommand(const char *cmd_line) {
-    std::string new_cmd_line = alias_map->replaceAlias(cmd_line);
-    string cmd_s = _trim(new_cmd_line);
-    string firstWord = cmd_s.substr(0, cmd_s.find_first_of(" \n"));
-    job_list->removeFinishedJobs();
+template <class T>
+static Command *make_alias_builtin(const ParsedCommandPtr &parsed, JobsList *, AliasMap *aliases) {
+    return new T(parsed, aliases);
+}
+
+// every built-in command; dispatch and the reserved alias names both come from here
+static constexpr BuiltinEntry builtins[] = {
+    {"pwd", make_builtin<GetCurrDirCommand>, STAGE_IN_SHELL},
+    {"showpid", make_builtin<ShowPidCommand>, STAGE_IN_SHELL},
+    {"chprompt", make_builtin<ChangePromptCommand>, STAGE_SUBSHELL},
+    {"cd", make_builtin<ChangeDirCommand>, STAGE_SUBSHELL},
+    {"jobs", make_jobs_builtin<JobsCommand>, STAGE_IN_SHELL},
+    {"fg", make_jobs_builtin<ForegroundCommand>, STAGE_REFUSED},
+    {"quit", make_jobs_builtin<QuitCommand>, STAGE_SUBSHELL},
+    {"kill", make_jobs_builtin<KillCommand>, STAGE_SUBSHELL},
+    {"alias", make_alias_builtin<AliasCommand>, STAGE_SUBSHELL},
+    {"unalias", make_alias_builtin<UnAliasCommand>, STAGE_SUBSHELL},
+    {"unsetenv", make_builtin<UnSetEnvCommand>, STAGE_SUBSHELL},
+    {"sysinfo", make_builtin<SysInfoCommand>, STAGE_IN_SHELL},
+    {"du", make_builtin<DiskUsageCommand>, STAGE_IN_SHELL},
+    {"whoami", make_builtin<WhoAmICommand>, STAGE_IN_SHELL},
+    {"usbinfo", make_builtin<USBInfoCommand>, STAGE_IN_SHELL},
+    {"hash", make_builtin<HashCommand>, STAGE_SUBSHELL},
+    {"timeout", make_builtin<TimeoutCommand>, STAGE_REFUSED},
+    {"time", make_builtin<TimeCommand>, STAGE_REFUSED},
+    {"stats", make_builtin<StatsCommand>, STAGE_IN_SHELL},
+};
+
+// FNV-1a of a name; the constexpr form feeds the case labels below, so two built-ins
+// whose hashes collide fail to compile
+static constexpr uint32_t name_hash(const char *name, uint32_t hash = 2166136261u) {
+    return *name ? name_hash(name + 1, (hash ^ static_cast<unsigned char>(*name)) * 16777619u) : hash;
+}
 
-    bool isRedirect = (cmd_s.find('>') != string::npos);
-    if (isRedirect) {
-        return new RedirectionCommand(cmd_s.c_str());
+static uint32_t name_hash_slice(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
     }
+    return hash;
+}
 
-    bool isPipe = (cmd_s.find('|') != string::npos);
-    if (isPipe) {
-        return new PipeCommand(cmd_s.c_str());
+#define BUILTIN_CASE(i) case name_hash(builtins[i].name): entry = &builtins[i]; break;
+
+const BuiltinEntry *findBuiltin(const char *name, size_t length) {
+    static_assert(sizeof(builtins) / sizeof(builtins[0]) == 19, "add a BUILTIN_CASE for every built-in");
+    const BuiltinEntry *entry;
+    switch (name_hash_slice(name, length)) {
+        BUILTIN_CASE(0) BUILTIN_CASE(1) BUILTIN_CASE(2) BUILTIN_CASE(3) BUILTIN_CASE(4)
+        BUILTIN_CASE(5) BUILTIN_CASE(6) BUILTIN_CASE(7) BUILTIN_CASE(8) BUILTIN_CASE(9)
+        BUILTIN_CASE(10) BUILTIN_CASE(11) BUILTIN_CASE(12) BUILTIN_CASE(13) BUILTIN_CASE(14)
+        BUILTIN_CASE(15) BUILTIN_CASE(16) BUILTIN_CASE(17) BUILTIN_CASE(18)
+        default:
+            return nullptr;
+    }
+    // a hash match only selects the candidate, the name itself still has to be equal
+    if (strncmp(entry->name, name, length) != 0 || entry->name[length] != '\0') {
+        return nullptr;
     }
+    return entry;
+}
 
+#undef BUILTIN_CASE
 
-    if (firstWord.compare("pwd") == 0) {
-      return new GetCurrDirCommand(cmd_s.c_str());
-    }
-    else if (firstWord.compare("showpid") == 0) {
-      return new ShowPidCommand(cmd_s.c_str());
+ParsedCommand::ParsedCommand(const std::string &expanded_line): line(_trim(expanded_line)), args(line.c_str()) {
+    if (line.find('>') != string::npos) {
+        kind = KIND_REDIRECTION;
+        CommandArgs tokens(line.c_str());
+        tokens.stripBackground();
+        int argc = tokens.size();
+        if (argc < 3) {
+            valid = false;
+        }
+        else if (std::string(tokens[argc - 2]) == ">") {
+            append = false;
+        }
+        else if (std::string(tokens[argc - 2]) == ">>") {
+            append = true;
+        }
+        else {
+            valid = false;
+        }
+        if (valid) {
+            target = tokens[argc - 1];
+            std::string cmd_s = line;
+            if (cmd_s.back() == '&') {
+                cmd_s.pop_back();
+            }
+            inner = _trim(cmd_s.substr(0, cmd_s.find_first_of('>')));
+            stages.emplace_back(inner.c_str());
+        }
+        return;
     }
-    else if (firstWord.compare("chprompt") == 0) {
-        return new ChangePromptCommand(cmd_s.c_str());
+
+    if (line.find('|') != string::npos) {
+        // split into stages, "|&" pipes the stderr of the stage on its left instead of stdout
+        kind = KIND_PIPE;
+        size_t begin = 0;
+        for (;;) {
+            size_t pos = line.find('|', begin);
+            stage_lines.push_back(_trim(line.substr(begin, pos == std::string::npos ? std::string::npos : pos - begin)));
+            stages.emplace_back(stage_lines.back().c_str());
+            if (pos == std::string::npos) {
+                break;
+            }
+            if (pos + 1 < line.size() && line[pos + 1] == '&') {
+                out_targets.push_back(STDERR_FILENO);
+                begin = pos + 2;
+            }
+            else {
+                out_targets.push_back(STDOUT_FILENO);
+                begin = pos + 1;
+            }
+        }
+        return;
     }
-    else if (firstWord.compare("cd") == 0) {
-        return new ChangeDirCommand(cmd_s.c_str());
+
+    size_t name_end = line.find_first_of(" \n");
+    builtin = findBuiltin(line.data(), name_end == std::string::npos ? line.size() : name_end);
+    kind = builtin ? KIND_BUILTIN : KIND_EXTERNAL;
+    if (kind == KIND_EXTERNAL) {
+        args.stripBackground();
     }
-    else if (firstWord.compare("jobs") == 0) {
-        return new JobsCommand(cmd_s.c_str(), job_list);
+}
+
+ParseCache::ParseCache(size_t capacity): capacity(capacity) {}
+
+std::shared_ptr<const ParsedCommand> ParseCache::get(const char *cmd_line, AliasMap &aliases) {
+    std::string raw_line(cmd_line);
+    auto it = index.find(raw_line);
+    if (it != index.end()) {
+        if (it->second->generation == aliases.getGeneration()) {
+            hits++;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->parsed;
+        }
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    misses++;
+    std::string expanded;
+    {
+        PhaseTimer timer(PHASE_ALIAS);
+        expanded = aliases.replaceAlias(cmd_line);
+    }
+    std::shared_ptr<const ParsedCommand> parsed = std::make_shared<ParsedCommand>(expanded);
+    entries.push_front(Entry{raw_line, aliases.getGeneration(), parsed});
+    index[raw_line] = entries.begin();
+    if (entries.size() > capacity) {
+        index.erase(entries.back().raw_line);
+        entries.pop_back();
+    }
+    return parsed;
+}
+
+bool PathCache::resolve(const char *name, std::string &path) {
+    const char *env = getenv("PATH");
+    if (search_path != (env ? env : "")) {
+        entries.clear();
+        search_path = env ? env : "";
+    }
+    if (env == nullptr || *name == '\0' || strchr(name, '/') != nullptr) {
+        return false; // execvp's own rules apply (default path, or no search at all)
+    }
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        hits++;
+        it->second.hits++;
+        path = it->second.path;
+        return true;
+    }
+    misses++;
+
+    // the same search as execvp: every PATH entry in order, an empty one is the cwd. Once a
+    // relative entry was searched the result depends on the cwd, so it is not remembered
+    bool relative = false;
+    for (size_t begin = 0; begin <= search_path.size();) {
+        size_t end = search_path.find(':', begin);
+        if (end == std::string::npos) {
+            end = search_path.size();
+        }
+        std::string dir = search_path.substr(begin, end - begin);
+        relative = relative || dir.empty() || dir[0] != '/';
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            if (!relative) {
+                entries[name] = Entry{candidate, 1};
+            }
+            path = candidate;
+            return true;
+        }
+        begin = end + 1;
     }
-    else if (firstWord.compare("fg") == 0) {
-        return new ForegroundCommand(cmd_s.c_str(), job_list);
+    return false;
+}
+
+void PathCache::forget(const char *name) {
+    entries.erase(name);
+}
+
+void PathCache::clear() {
+    entries.clear();
+}
+
+// the first PATH entry that is not an absolute directory ("" is the cwd), false if none
+static bool first_relative_path_entry(const char *search_path, std::string &entry) {
+    for (const char *begin = search_path;; ) {
+        const char *end = strchrnul(begin, ':');
+        if (*begin != '/') {
+            entry.assign(begin, end - begin);
+            return true;
+        }
+        if (*end == '\0') {
+            return false;
+        }
+        begin = end + 1;
     }
-    else if (firstWord.compare("quit") == 0) {
-        return new QuitCommand(cmd_s.c_str(), job_list);
+}
+
+void PathCache::print() const {
+    const char *env = getenv("PATH");
+    std::string relative;
+    if (env && first_relative_path_entry(env, relative)) {
+        std::cout << "hash: PATH entry \"" << relative << "\" is relative, commands found from it on are not cached\n";
     }
-    else if (firstWord.compare("kill") == 0) {
-        return new KillCommand(cmd_s.c_str(), job_list);
+    if (entries.empty()) {
+        std::cout << "hash: hash table empty\n";
     }
-    else if (firstWord.compare("alias") == 0) {
-        return new AliasCommand(cmd_s.c_str(), alias_map);
+    else {
+        std::vector<std::pair<std::string, unsigned long> > rows;
+        for (const auto &entry : entries) {
+            rows.push_back({entry.second.path, entry.second.hits});
+        }
+        std::sort(rows.begin(), rows.end());
+        std::cout << "hits\tcommand\n";
+        for (const auto &row : rows) {
+            std::cout << std::setw(4) << row.second << "\t" << row.first << '\n';
+        }
     }
-    else if (firstWord.compare("unalias") == 0) {
-        return new UnAliasCommand(cmd_s.c_str(), alias_map);
+    std::cout << "lookups: " << hits << " hits, " << misses << " misses\n";
+}
+
+void LatencyHistogram::record(unsigned long long ns) {
+    int bucket;
+    if (ns < 2 * SUB_BUCKETS) {
+        bucket = static_cast<int>(ns);
     }
-    else if (firstWord.compare("unsetenv") == 0) {
-        return new UnSetEnvCommand(cmd_s.c_str());
+    else {
+        // keep the top 5 bits: 1 for the power of two and 4 for the sub-bucket
+        int shift = 63 - __builtin_clzll(ns) - 4;
+        bucket = (shift + 1) * SUB_BUCKETS + static_cast<int>(ns >> shift) - SUB_BUCKETS;
     }
-    else if (firstWord.compare("sysinfo") == 0) {
-        return new SysInfoCommand(cmd_s.c_str());
+    counts[bucket]++;
+    count++;
+    total += ns;
+    if (ns > max) {
+        max = ns;
     }
-    else if (firstWord.compare("du") == 0) {
-        return new DiskUsageCommand(cmd_s.c_str());
+}
+
+unsigned long long LatencyHistogram::bucketLimit(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return bucket;
     }
-    else if (firstWord.compare("whoami") == 0) {
-        return new WhoAmICommand(cmd_s.c_str());
+    int shift = bucket / SUB_BUCKETS - 1;
+    unsigned long long sub = SUB_BUCKETS + bucket % SUB_BUCKETS + 1;
+    return (sub << shift) - 1; // wraps to the largest value for the very last bucket
+}
+
+unsigned long long LatencyHistogram::percentile(double p) const {
+    unsigned long rank = static_cast<unsigned long>(p * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
     }
-    else if (firstWord.compare("usbinfo") == 0) {
-        return new USBInfoCommand(cmd_s.c_str());
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < BUCKETS && count > 0; ++bucket) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            return std::min(bucketLimit(bucket), max);
+        }
     }
-    else {
-        return new ExternalCommand(cmd_s.c_str());
+    return max;
+}
+
+PhaseTimer::PhaseTimer(Phase phase): phase(phase) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+PhaseTimer::~PhaseTimer() {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    SmallShell::getInstance().getLatency(phase).record(timespec_ns(end) - timespec_ns(start));
+}
+
+/**
+* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
+*/
+Command *SmallShell::CreateCommand(const char *cmd_line) {
+    {
+        PhaseTimer timer(PHASE_JOBS);
+        job_list->removeFinishedJobs();
+    }
+    PhaseTimer timer(PHASE_PARSE);
+    ParsedCommandPtr parsed = parse_cache.get(cmd_line, *alias_map);
+
+    switch (parsed->kind) {
+        case KIND_REDIRECTION:
+            return new RedirectionCommand(parsed);
+        case KIND_PIPE:
+            return new PipeCommand(parsed);
+        case KIND_BUILTIN:
+            return parsed->builtin->factory(parsed, job_list, alias_map);
+        case KIND_EXTERNAL:
+        default:
+            return new ExternalCommand(parsed);
     }
 }
 
@@ -308,13 +2476,63 @@ JobsList *SmallShell::getJobsList() const{
 
 
 void SmallShell::executeCommand(const char *cmd_line) {
-
-    Command* cmd = CreateCommand(cmd_line);
+    PhaseTimer timer(PHASE_COMMAND);
+    std::unique_ptr<Command> cmd(CreateCommand(cmd_line));
 
     cmd->setPID(getpid());
     cmd->execute();
+    std::cout.flush(); // output is batched per command
+}
+
+
+const char *SmallShell::phaseName(Phase phase) {
+    static const char *const names[PHASE_COUNT] = {"alias", "parse", "jobs", "spawn", "wait", "command"};
+    return names[phase];
+}
+
+void SmallShell::resetLatency() {
+    for (LatencyHistogram &histogram : latency) {
+        histogram = LatencyHistogram();
+    }
 }
 
+void SmallShell::dumpStats() {
+    const char *path = getenv("SMASH_STATS_JSON");
+    if (path == nullptr || *path == '\0') {
+        return;
+    }
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        perror("smash error: open failed");
+        return;
+    }
+    out << "{\n  \"phases\": {";
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        const LatencyHistogram &histogram = latency[i];
+        out << (i ? ",\n" : "\n") << "    \"" << phaseName(static_cast<Phase>(i)) << "\": {"
+            << "\"count\": " << histogram.getCount()
+            << ", \"mean_ns\": " << histogram.getMean()
+            << ", \"p50_ns\": " << histogram.percentile(0.5)
+            << ", \"p90_ns\": " << histogram.percentile(0.9)
+            << ", \"p99_ns\": " << histogram.percentile(0.99)
+            << ", \"max_ns\": " << histogram.getMax()
+            << ", \"buckets\": [";
+        // only the used buckets, as [largest value in the bucket, count]
+        bool first = true;
+        for (int bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+            if (histogram.getBucket(bucket)) {
+                out << (first ? "" : ", ") << "[" << LatencyHistogram::bucketLimit(bucket) << ", "
+                    << histogram.getBucket(bucket) << "]";
+                first = false;
+            }
+        }
+        out << "]}";
+    }
+    out << "\n  },\n"
+        << "  \"parse_cache\": {\"hits\": " << parse_cache.getHits() << ", \"misses\": " << parse_cache.getMisses() << "},\n"
+        << "  \"path_cache\": {\"hits\": " << path_cache.getHits() << ", \"misses\": " << path_cache.getMisses() << "}\n"
+        << "}\n";
+}
 
 std::string SmallShell::getPrompt() const {
     return prompt;
@@ -347,194 +2565,228 @@ void SmallShell::setLastDir(const std::string &last_dir) {
 // start of commands --------------------------------------------------------------------
 
 
-Command::~Command() {
-    free((void *)cmd_line);
-}
+Command::~Command() = default;
 
-PipeCommand::PipeCommand(const char *cmd_line): Command(cmd_line){}
+void *Command::operator new(size_t size) {
+    return CommandPool::instance().allocate(size);
+}
 
+void Command::operator delete(void *p, size_t size) {
+    CommandPool::instance().deallocate(p, size);
+}
 
-void PipeCommand::execute() {
-    std::string line(cmd_line);
-    size_t pos = line.find("|&");
-    bool is_stderr_pipe = false;
-    if(pos != std::string::npos) {
-        is_stderr_pipe = true;
-    }
-    else {
-        pos = line.find('|');
-    }
-    std::string left  = _trim(line.substr(0, pos));
-    std::string right = _trim(line.substr(pos + 1));
+PipeCommand::PipeCommand(const ParsedCommandPtr &parsed): Command(parsed) {}
 
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("smash error: pipe failed");
-        return;
-    }
 
-    pid_t left_pid = fork();
-    if (left_pid == -1) {
-        perror("smash error: fork failed");
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return;
+void PipeCommand::execute() {
+    const std::deque<CommandArgs>& stages = parsed->stages;
+    const std::vector<int>& out_targets = parsed->out_targets;
+
+    // create every pipe up front; O_CLOEXEC keeps the unused ends out of the children
+    size_t pipe_count = stages.size() - 1;
+    std::vector<int> pipes(2 * pipe_count);
+    for (size_t i = 0; i < pipe_count; ++i) {
+        if (pipe2(&pipes[2 * i], O_CLOEXEC) == -1) {
+            perror("smash error: pipe failed");
+            for (size_t j = 0; j < 2 * i; ++j) {
+                close(pipes[j]);
+            }
+            return;
+        }
     }
 
-    if (left_pid == 0) {
-
-        setpgrp();
-        if(is_stderr_pipe) {
-            if (dup2(pipefd[1], STDERR_FILENO) == -1) {
-                perror("smash error: dup2 failed");
-                exit(1);
+    // all stages join the process group of the first one, so ctrl-C reaches them all
+    pid_t pgid = 0;
+    int running = 0;
+    std::vector<int> cat_fds;
+    std::vector<size_t> builtin_stages;
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const CommandArgs& stage_args = stages[i];
+        if (stage_args.size() == 0) {
+            continue;
+        }
+        if (findBuiltin(stage_args[0], strlen(stage_args[0])) != nullptr) {
+            builtin_stages.push_back(i); // runs once the external stages are up
+            continue;
+        }
+        // only when cat's stdout is what goes down the pipe, "cat f |& cmd" pipes stderr
+        if (i == 0 && pipe_count > 0 && out_targets[0] == STDOUT_FILENO && open_cat_operands(stage_args, cat_fds)) {
+            if (cat_fds.size() > 1) {
+                // several files: a feeder child splices them into the pipe, no exec needed
+                std::cout.flush();
+                pid_t feeder = fork();
+                if (feeder == 0) {
+                    setpgid(0, 0);
+                    for (size_t j = 0; j < pipes.size(); ++j) {
+                        if (j != 1) {
+                            close(pipes[j]); // keep only our write end, so a dead reader gives EPIPE
+                        }
+                    }
+                    for (int in_fd : cat_fds) {
+                        copy_fd(in_fd, pipes[1]);
+                    }
+                    _exit(0);
+                }
+                if (feeder == -1) {
+                    perror("smash error: fork failed");
+                }
+                else {
+                    setpgid(feeder, feeder); // as in the child: the group must exist before the next spawn joins it
+                    pgid = feeder;
+                    running++;
+                }
             }
+            continue;
         }
-        else {
-            if (dup2(pipefd[1], STDOUT_FILENO) == -1) {
-                perror("smash error: dup2 failed");
-                exit(1);
+        std::vector<std::pair<int, int> > dups;
+        if (i == 1 && cat_fds.size() == 1) {
+            dups.push_back({cat_fds[0], STDIN_FILENO}); // "cat file | cmd" reads the file directly
+        }
+        else if (i > 0) {
+            dups.push_back({pipes[2 * (i - 1)], STDIN_FILENO});
+        }
+        if (i < pipe_count) {
+            dups.push_back({pipes[2 * i + 1], out_targets[i]});
+        }
+        pid_t stage_pid = spawn_process(stage_args.argv(), pgid, dups);
+        if (stage_pid > 0) {
+            if (pgid == 0) {
+                pgid = stage_pid;
             }
+            running++;
         }
-
-        close(pipefd[0]);
-        close(pipefd[1]);
-
-
-        char *args[COMMAND_MAX_ARGS + 1];
-        int argc = _parseCommandLine(left.c_str(), args);
-        execvp(args[0], args);
-        perror("smash error: execvp failed");
-        exit(1);
-    }
-
-    pid_t right_pid = fork();
-    if (right_pid == -1) {
-        perror("smash error: fork failed");
-
-        close(pipefd[0]);
-        close(pipefd[1]);
-        return;
     }
 
-    if (right_pid == 0) {
-
-        setpgrp();
-        if (dup2(pipefd[0], STDIN_FILENO) == -1) {
-            perror("smash error: dup2 failed");
-            exit(1);
+    if (!builtin_stages.empty()) {
+        // keep only the write ends the built-ins use: a reader then sees EOF once its
+        // writer is done, and a writer gets EPIPE when its reader exited (or is a built-in,
+        // those never read) instead of blocking on a full pipe
+        for (size_t j = 0; j < pipe_count; ++j) {
+            close(pipes[2 * j]);
+            pipes[2 * j] = -1;
+            if (std::find(builtin_stages.begin(), builtin_stages.end(), j) == builtin_stages.end()) {
+                close(pipes[2 * j + 1]);
+                pipes[2 * j + 1] = -1;
+            }
         }
-        close(pipefd[1]);
-        close(pipefd[0]);
-
-        char *args[COMMAND_MAX_ARGS + 1];
-        int argc = _parseCommandLine(right.c_str(), args);
-        execvp(args[0], args);
-        perror("smash error: execvp failed");
-        exit(1);
+        struct sigaction ignore_pipe = {}, saved_pipe;
+        ignore_pipe.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore_pipe, &saved_pipe);
+        for (size_t i : builtin_stages) {
+            const BuiltinEntry *entry = findBuiltin(stages[i][0], strlen(stages[i][0]));
+            if (entry->stage_mode == STAGE_REFUSED) {
+                std::cerr << "smash error: " << entry->name << ": cannot be used in a pipeline" << std::endl;
+                continue;
+            }
+            std::unique_ptr<Command> cmd(SmallShell::getInstance().CreateCommand(parsed->stage_lines[i].c_str()));
+            if (entry->stage_mode == STAGE_SUBSHELL) {
+                // "cd x | cat" must not move smash itself, so it runs in a child of the pipeline group
+                std::cout.flush();
+                pid_t child = fork();
+                if (child == 0) {
+                    setpgid(0, pgid);
+                    if (i < pipe_count) {
+                        dup2(pipes[2 * i + 1], out_targets[i]);
+                    }
+                    cmd->setPID(getpid());
+                    cmd->execute();
+                    std::cout.flush();
+                    _exit(0);
+                }
+                if (child == -1) {
+                    perror("smash error: fork failed");
+                    continue;
+                }
+                setpgid(child, pgid == 0 ? child : pgid);
+                if (pgid == 0) {
+                    pgid = child;
+                }
+                running++;
+                continue;
+            }
+            cmd->setPID(getpid());
+            if (i < pipe_count) {
+                OutputRedirect redirect(out_targets[i], pipes[2 * i + 1]);
+                cmd->execute();
+            }
+            else {
+                cmd->execute();
+            }
+        }
+        sigaction(SIGPIPE, &saved_pipe, nullptr);
     }
 
+    for (int fd : pipes) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    for (int fd : cat_fds) {
+        close(fd);
+    }
 
-    close(pipefd[0]);
-    close(pipefd[1]);
-
-
-    int status;
-    setForegroundPid(right_pid); //by killing right_pid we will also kill left_pid
-    waitpid(left_pid, &status, 0);
-    waitpid(right_pid, &status, 0);
-    setForegroundPid(0);
+    if (running == 0) {
+        return;
+    }
+    PhaseTimer timer(PHASE_WAIT);
+    waitForeground(pgid, true, running);
 }
 
 
 
-RedirectionCommand::RedirectionCommand(const char *cmd_line): Command(cmd_line) {}
+RedirectionCommand::RedirectionCommand(const ParsedCommandPtr &parsed): Command(parsed) {}
 
 void RedirectionCommand::execute() {
-    std::string cmd_s = cmd_line;
-    if (cmd_s.back() == '&') {
-        cmd_s.pop_back();
-    }
-    cmd_s = _trim(cmd_s);
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_s.c_str(), args);
-    int flag = 0;
-    if (argc < 3) {
-        for (int i = 0; i < argc; i++) {
-            free(args[i]);
-        }
-        return;
-    }
-    else if (std::string(args[argc - 2]) == ">") {
-        flag = O_TRUNC;
-    }
-    else if (std::string(args[argc - 2]) == ">>") {
-        flag = O_APPEND;
-    }
-    else {
-        for (int i = 0; i < argc; i++) {
-            free(args[i]);
-        }
+    if (!parsed->valid) {
         return;
     }
-    int fd = open(args[argc - 1], O_WRONLY | O_CREAT | flag, 0666);
+    int fd = open(parsed->target.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (parsed->append ? O_APPEND : O_TRUNC),
+                  0666);
     if (fd == -1) {
         perror("smash error: open failed");
-        for (int i = 0; i < argc; i++) {
-            free(args[i]);
-        }
         return;
     }
-    int saved_stdout = dup(1);
-    if (saved_stdout == -1) {
-        perror("smash error: dup failed");
-        close(fd);
-        for (int i = 0; i < argc; i++) {
-            free(args[i]);
+
+    // "cat file... > target": forward the files in the kernel instead of running cat
+    std::vector<int> cat_fds;
+    if (open_cat_operands(parsed->stages[0], cat_fds, fd)) {
+        for (int in_fd : cat_fds) {
+            if (!copy_fd(in_fd, fd)) {
+                perror("smash error: write failed");
+            }
+            close(in_fd);
         }
-        return;
-    }
-    if (dup2(fd, STDOUT_FILENO) == -1) {
-        perror("smash error: dup2 failed");
         close(fd);
-        for (int i = 0; i < argc; i++) {
-            free(args[i]);
-        }
         return;
     }
-    close(fd);
-    for (int i = 0; i < argc; i++) {
-        free(args[i]);
+
+    // built-ins write through std::cout, external commands get fd as their stdout
+    std::unique_ptr<Command> cmd(SmallShell::getInstance().CreateCommand(parsed->inner.c_str()));
+    {
+        OutputRedirect redirect(STDOUT_FILENO, fd);
+        cmd->execute();
     }
-    cmd_s = cmd_s.substr(0, cmd_s.find_first_of('>'));
-    cmd_s = _trim(cmd_s);
-    Command *cmd = SmallShell::getInstance().CreateCommand(cmd_s.c_str());
-    cmd->execute();
-    dup2(saved_stdout, 1);
+    close(fd);
 }
 
 
 
-ChangePromptCommand::ChangePromptCommand(const char *cmd_line): BuiltInCommand(cmd_line){}
+ChangePromptCommand::ChangePromptCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed){}
 
 
 
 void ChangePromptCommand::execute() {
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     if (argc <= 1) SmallShell::getInstance().setPrompt("smash");
     else {
         std::string prompt = args[1];
         SmallShell::getInstance().setPrompt(prompt);
     }
-    for (int i = 0; i < argc; i++) {
-        free(args[i]);
-    }
 }
 
 
 
-GetCurrDirCommand::GetCurrDirCommand(const char *cmd_line): BuiltInCommand(cmd_line) {}
+GetCurrDirCommand::GetCurrDirCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
 
 void GetCurrDirCommand::execute() {
     char* buffer = getcwd(NULL, 0);
@@ -548,7 +2800,7 @@ void GetCurrDirCommand::execute() {
 
 
 
-ShowPidCommand::ShowPidCommand(const char *cmd_line): BuiltInCommand(cmd_line){}
+ShowPidCommand::ShowPidCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed){}
 
 void ShowPidCommand::execute() {
     std::cout << "smash pid is " << getpid() << '\n';
@@ -556,28 +2808,21 @@ void ShowPidCommand::execute() {
 
 
 
-ChangeDirCommand::ChangeDirCommand(const char *cmd_line): BuiltInCommand(cmd_line) {}
+ChangeDirCommand::ChangeDirCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
 
 void ChangeDirCommand::execute() {
     SmallShell &smash = SmallShell::getInstance();
 
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
 
     // cd with no arguments -> no impact
     if (argc == 1) {
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
     // more than one argument -> error
     if (argc > 2) {
         std::cerr << ("smash error: cd: too many arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
@@ -585,9 +2830,6 @@ void ChangeDirCommand::execute() {
     char cwd[1024];
     if (!getcwd(cwd, sizeof(cwd))) {
         perror("smash error: getcwd failed");
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
@@ -597,9 +2839,6 @@ void ChangeDirCommand::execute() {
         const std::string &last = smash.getLastDir();
         if (last.empty()) {
             std::cerr<<("smash error: cd: OLDPWD not set")<<std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         target = last.c_str();
@@ -608,96 +2847,322 @@ void ChangeDirCommand::execute() {
     }
     if (chdir(target) == -1) {
         perror("smash error: chdir failed");
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
     smash.setLastDir(std::string(cwd));
 
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
+}
+size_t JobsList::SlotIndex::bucket(int key) const {
+    return (static_cast<unsigned int>(key) * 2654435761U) & (table.size() - 1);
+}
+
+void JobsList::SlotIndex::grow() {
+    std::vector<std::pair<int, int> > old;
+    old.swap(table);
+    table.assign(old.empty() ? 16 : old.size() * 2, std::make_pair(0, -1));
+    used = 0;
+    for (const auto& entry : old) {
+        if (entry.first != 0) {
+            insert(entry.first, entry.second);
+        }
+    }
+}
+
+int JobsList::SlotIndex::find(int key) const {
+    if (table.empty()) {
+        return -1;
+    }
+    for (size_t i = bucket(key);; i = (i + 1) & (table.size() - 1)) {
+        if (table[i].first == key) {
+            return table[i].second;
+        }
+        if (table[i].first == 0) {
+            return -1;
+        }
+    }
+}
+
+void JobsList::SlotIndex::insert(int key, int slot) {
+    if ((used + 1) * 2 > static_cast<int>(table.size())) {
+        grow();
+    }
+    size_t i = bucket(key);
+    while (table[i].first != 0 && table[i].first != key) {
+        i = (i + 1) & (table.size() - 1);
+    }
+    if (table[i].first == 0) {
+        used++;
+    }
+    table[i] = std::make_pair(key, slot);
+}
+
+void JobsList::SlotIndex::erase(int key) {
+    if (table.empty()) {
+        return;
+    }
+    size_t mask = table.size() - 1;
+    size_t i = bucket(key);
+    while (table[i].first != key) {
+        if (table[i].first == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    // backward-shift deletion: pull later entries of the probe run into the hole
+    for (size_t j = (i + 1) & mask; table[j].first != 0; j = (j + 1) & mask) {
+        size_t home = bucket(table[j].first);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
+        }
     }
+    table[i] = std::make_pair(0, -1);
+    used--;
 }
-JobsList::JobsList() : max_job_id(0) {}
+
+JobsList::JobsList() : max_job_id(0), pidfd_epoll(epoll_create1(EPOLL_CLOEXEC)) {}
 JobsList::~JobsList() {
-    for (auto job:jobs) {
-        delete job;
+    for (int slot = head; slot != -1; slot = slots[slot].next) {
+        if (slots[slot].pidfd != -1) {
+            close(slots[slot].pidfd);
+        }
+    }
+    if (pidfd_epoll != -1) {
+        close(pidfd_epoll);
     }
-    jobs.clear();
 }
-void JobsList::addJob(Command *cmd, bool is_stopped) {
-    removeFinishedJobs();
+void JobsList::addJob(pid_t pid, const std::string &cmd_line, const struct timespec &start, bool is_stopped,
+                      unsigned long timeout_id) {
+    // no reaping here: waitpid(-1) could collect this very child before it is in the list
     int new_job_id = ++max_job_id;
-    jobs.push_back(new JobEntry(new_job_id, cmd->getPID(), cmd->getCMD(), is_stopped));
+    int slot;
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        JobEntry &job = slots[slot];
+        job.job_id = new_job_id;
+        job.pid = pid;
+        job.is_stopped = is_stopped;
+        job.cmd_line = cmd_line;
+    }
+    else {
+        slot = static_cast<int>(slots.size());
+        slots.emplace_back(new_job_id, pid, cmd_line, is_stopped);
+    }
+    JobEntry &job = slots[slot];
+    job.timeout_id = timeout_id;
+    job.start = start;
+    job.prev = tail;
+    job.next = -1;
+    if (tail != -1) {
+        slots[tail].next = slot;
+    }
+    else {
+        head = slot;
+    }
+    tail = slot;
+    by_id.insert(new_job_id, slot);
+    by_pid.insert(job.pid, slot);
+    count++;
+    job.pidfd = pidfd_epoll == -1 ? -1 : openPidfd(job.pid);
+    if (job.pidfd != -1) {
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot;
+        if (epoll_ctl(pidfd_epoll, EPOLL_CTL_ADD, job.pidfd, &ev) == -1) {
+            close(job.pidfd);
+            job.pidfd = -1;
+        }
+        else {
+            pidfd_jobs++;
+        }
+    }
+    if (is_stopped) {
+        stopped_count++;
+    }
+}
+void JobsList::removeSlot(int slot) {
+    JobEntry &job = slots[slot];
+    if (job.prev != -1) {
+        slots[job.prev].next = job.next;
+    }
+    else {
+        head = job.next;
+    }
+    if (job.next != -1) {
+        slots[job.next].prev = job.prev;
+    }
+    else {
+        tail = job.prev;
+    }
+    by_id.erase(job.job_id);
+    by_pid.erase(job.pid);
+    if (job.pidfd != -1) {
+        close(job.pidfd); // also drops it from pidfd_epoll
+        job.pidfd = -1;
+        pidfd_jobs--;
+    }
+    if (job.timeout_id) {
+        cancelTimeout(job.timeout_id); // the pid may be reused from now on
+        job.timeout_id = 0;
+    }
+    if (job.is_stopped) {
+        stopped_count--;
+    }
+    count--;
+    free_slots.push_back(slot);
+}
+// the reaped jobs `jobs -l` still shows
+const size_t FINISHED_HISTORY = 64;
+
+void JobsList::finishSlot(int slot, int status, const struct rusage &usage) {
+    JobEntry &job = slots[slot];
+    clock_gettime(CLOCK_MONOTONIC, &job.end);
+    job.status = status;
+    job.usage = usage;
+    if (finished.size() == FINISHED_HISTORY) {
+        finished.pop_front();
+    }
+    finished.push_back(job);
+    removeSlot(slot);
 }
-void JobsList::printJobsList() {
+void JobsList::finishJob(int jobId, int status, const struct rusage &usage) {
+    int slot = by_id.find(jobId);
+    if (slot != -1) {
+        finishSlot(slot, status, usage);
+    }
+}
+void JobsList::printJobsList(bool long_format) {
     removeFinishedJobs();
-    //Jobs should already be sorted, but it should be further checked
-    for (auto job: jobs) {
-        std::cout<< "[" << job->job_id << "] " << job->cmd_line << std::endl;
+    if (!long_format) {
+        for (int slot = head; slot != -1; slot = slots[slot].next) {
+            const JobEntry &job = slots[slot];
+            std::cout<< "[" << job.job_id << "] " << job.cmd_line << '\n';
+        }
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int slot = head; slot != -1; slot = slots[slot].next) {
+        const JobEntry &job = slots[slot];
+        std::cout << "[" << job.job_id << "] " << job.pid << (job.is_stopped ? " stopped " : " running ")
+                  << format_seconds(timespec_ns(now) - timespec_ns(job.start)) << ": " << job.cmd_line << '\n';
+    }
+    if (finished.empty()) {
+        return;
+    }
+    std::cout << "finished:\n";
+    for (const JobEntry &job : finished) {
+        std::cout << "[" << job.job_id << "] " << job.pid;
+        if (WIFSIGNALED(job.status)) {
+            std::cout << " signal " << WTERMSIG(job.status);
+        }
+        else {
+            std::cout << " exit " << WEXITSTATUS(job.status);
+        }
+        std::cout << ", real " << format_seconds(timespec_ns(job.end) - timespec_ns(job.start))
+                  << ", user " << format_seconds(timeval_ns(job.usage.ru_utime))
+                  << ", sys " << format_seconds(timeval_ns(job.usage.ru_stime))
+                  << ", max rss " << job.usage.ru_maxrss << " KB"
+                  << ", ctx switches " << job.usage.ru_nvcsw << "/" << job.usage.ru_nivcsw
+                  << ": " << job.cmd_line << '\n';
     }
 }
 void JobsList::killAllJobs() {
     removeFinishedJobs();
-    for (auto job: jobs) {
-        //find why this can't resolve kill
-        if (kill(job->pid, SIGKILL) ==0) {
-            std::cout << job->pid << ": " << job->cmd_line << std::endl;
+    for (int slot = head; slot != -1; slot = slots[slot].next) {
+        const JobEntry &job = slots[slot];
+        if (sendSignal(job.pid, job.pidfd, SIGKILL) ==0) {
+            std::cout << job.pid << ": " << job.cmd_line << '\n';
         }
         else {
+            std::cout.flush(); // perror bypasses the stream, keep the list in order
             perror("smash error: kill failed");
         }
     }
 }
 void JobsList::removeFinishedJobs() {
-    auto it = jobs.begin();
-    while (it != jobs.end()) {
-        int status;
-        pid_t result = waitpid((*it)->pid, &status, WNOHANG);
-        if (result > 0) {
-            delete *it;
-            it = jobs.erase(it);
+    // foreground children are waited for synchronously, so anything reaped here is a job
+    if (!takeChildEvents()) {
+        return;
+    }
+    int status;
+    struct rusage usage;
+    if (pidfd_jobs == count && pidfd_epoll != -1) {
+        // every job has a pidfd: one epoll_wait names exactly the jobs that exited
+        struct epoll_event events[64];
+        int n;
+        do {
+            n = epoll_wait(pidfd_epoll, events, 64, 0);
+            for (int i = 0; i < n; ++i) {
+                int slot = static_cast<int>(events[i].data.u32);
+                if (wait4(slots[slot].pid, &status, WNOHANG, &usage) > 0) {
+                    finishSlot(slot, status, usage);
+                }
+                else {
+                    removeSlot(slot);
+                }
+            }
+        } while (n == 64);
+        if (getStrayChildren() == 0) {
+            return;
+        }
+    }
+    // all jobs when some have no pidfd, and children that are no job (a pipeline stage
+    // left behind by its group, only polled for while one is known to exist)
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        int slot = by_pid.find(pid);
+        if (slot != -1) {
+            finishSlot(slot, status, usage);
         }
         else {
-            it++;
+            addStrayChildren(-1);
         }
     }
+    if (pid == -1 && errno == ECHILD) {
+        addStrayChildren(-getStrayChildren()); // no children left at all
+    }
 }
-JobsList::JobEntry *JobsList::getJobById(int jobId) {
-    for (auto job:jobs) {
-        if (job->job_id == jobId) {
-            return job;
-        }
+void JobsList::setJobStopped(int jobId, bool stopped) {
+    JobEntry *job = getJobById(jobId);
+    if (job && job->is_stopped != stopped) {
+        job->is_stopped = stopped;
+        stopped_count += stopped ? 1 : -1;
     }
-    return nullptr;
+}
+JobsList::JobEntry *JobsList::getJobById(int jobId) {
+    int slot = by_id.find(jobId);
+    return slot == -1 ? nullptr : &slots[slot];
+}
+JobsList::JobEntry *JobsList::getJobByPid(pid_t pid) {
+    int slot = by_pid.find(pid);
+    return slot == -1 ? nullptr : &slots[slot];
 }
 void JobsList::removeJobById(int jobId) {
-    for (auto it = jobs.begin(); it != jobs.end(); it++) {
-        if ((*it)->job_id == jobId) {
-            delete *it;
-            jobs.erase(it);
-            return;
-        }
+    int slot = by_id.find(jobId);
+    if (slot != -1) {
+        removeSlot(slot);
     }
 }
 JobsList::JobEntry *JobsList::getLastJob(int *lastJobId) {
     removeFinishedJobs();
-    if(jobs.empty()) {
+    if(tail == -1) {
         return nullptr;
     }
     if (lastJobId) {
-        *lastJobId = jobs.back()->job_id;
+        *lastJobId = slots[tail].job_id;
     }
-    return jobs.back();
+    return &slots[tail];
 }
 JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
     removeFinishedJobs();
     JobEntry* last_stopped = nullptr;
-    for (auto job : jobs) {
-        if (job->is_stopped) {
-            last_stopped = job;
+    for (int slot = tail; stopped_count > 0 && slot != -1; slot = slots[slot].prev) {
+        if (slots[slot].is_stopped) {
+            last_stopped = &slots[slot];
+            break;
         }
     }
     if (jobId) {
@@ -709,25 +3174,21 @@ JobsList::JobEntry *JobsList::getLastStoppedJob(int *jobId) {
     }
     return last_stopped;
 }
-JobsCommand::JobsCommand(const char *cmd_line, JobsList *jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+JobsCommand::JobsCommand(const ParsedCommandPtr &parsed, JobsList *jobs) : BuiltInCommand(parsed), jobs(jobs) {}
 void JobsCommand::execute() {
-    jobs->printJobsList();
+    jobs->printJobsList(args.size() > 1 && strcmp(args[1], "-l") == 0);
 }
 
-ForegroundCommand::ForegroundCommand(const char *cmd_line, JobsList *jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+ForegroundCommand::ForegroundCommand(const ParsedCommandPtr &parsed, JobsList *jobs) : BuiltInCommand(parsed), jobs(jobs) {}
 
 void ForegroundCommand::execute() {
     jobs-> removeFinishedJobs();
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     int job_id = 0;
     JobsList::JobEntry *job = nullptr;
     if (argc == 1) {
         if (jobs->isEmpty()) {
             std::cerr<<("smash error: fg: jobs list is empty")<<std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         job = jobs->getLastJob(&job_id);
@@ -737,9 +3198,6 @@ void ForegroundCommand::execute() {
         job_id = strtol(args[1], &endptr, 10);
         if (*endptr != '\0'||job_id <=0) {
             std::cerr<<("smash error: fg: invalid arguments")<<std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         job = jobs->getJobById(job_id);
@@ -748,34 +3206,38 @@ void ForegroundCommand::execute() {
             error += std::to_string(job_id);
             error += " does not exist";
             std::cerr << (error.c_str()) << std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
     }
     else {
         std::cerr<<("smash error: fg: invalid arguments")<<std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
-    std::cout << job->cmd_line << " " << job->pid << std::endl;
+    std::cout << job->cmd_line << " " << job->pid << '\n';
+    if (job->is_stopped) {
+        if (sendSignal(job->pid, job->pidfd, SIGCONT) == -1) {
+            std::cout.flush();
+            perror("smash error: kill failed");
+        }
+        jobs->setJobStopped(job_id, false);
+    }
+    // the shared total is left alone, an enclosing time still collects it
+    struct rusage usage{};
     int status;
-    setForegroundPid(job->pid);
-    waitpid(job->pid, &status, 0); // Maybe should add WUNTRACED flag
-    setForegroundPid(0);
-    jobs->removeJobById(job_id);
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
+    {
+        PhaseTimer timer(PHASE_WAIT);
+        status = waitForeground(job->pid, false, 1, &usage);
+    }
+    if (WIFSTOPPED(status)) {
+        jobs->setJobStopped(job_id, true); // ctrl-Z again: it stays in the list
+        return;
     }
+    jobs->finishJob(job_id, status, usage);
 }
 
-QuitCommand::QuitCommand(const char *cmd_line, JobsList *jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+QuitCommand::QuitCommand(const ParsedCommandPtr &parsed, JobsList *jobs) : BuiltInCommand(parsed), jobs(jobs) {}
 void QuitCommand::execute() {
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     bool kill = false;
     if (argc >1 && strcmp(args[1], "kill") == 0) {
         kill = true;
@@ -784,48 +3246,33 @@ void QuitCommand::execute() {
 
         int job_count = jobs->getJobCount();
 
-        std::cout << "smash: sending SIGKILL signal to " << job_count <<" jobs:"<< std::endl;
+        std::cout << "smash: sending SIGKILL signal to " << job_count << " jobs:\n";
         jobs->killAllJobs();
     }
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
+    SmallShell::getInstance().dumpStats();
     exit(0);
 }
 
-KillCommand::KillCommand(const char *cmd_line, JobsList *jobs) : BuiltInCommand(cmd_line), jobs(jobs) {}
+KillCommand::KillCommand(const ParsedCommandPtr &parsed, JobsList *jobs) : BuiltInCommand(parsed), jobs(jobs) {}
 void KillCommand::execute() {
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     if (argc != 3) {
         std::cerr<<("smash error: kill: invalid arguments")<<std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     if (args[1][0] != '-') {
         std::cerr << ("smash error: kill: invalid arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     char* endptr;
     int signum = strtol(args[1]+1, &endptr, 10);
     if (*endptr != '\0'||signum <=0) {
         std::cerr << ("smash error: kill: invalid arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     int job_id = strtol(args[2], &endptr, 10);
     if (*endptr != '\0'||job_id <=0) {
          std::cerr << ("smash error: kill: invalid arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     JobsList::JobEntry* job = jobs->getJobById(job_id);
@@ -834,70 +3281,45 @@ void KillCommand::execute() {
         error += std::to_string(job_id);
         error += " does not exist";
          std::cerr << (error.c_str()) << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     //here maybe a check of was it successful is necessary
-    if (kill(job->pid, signum)!=0) {
+    if (sendSignal(job->pid, job->pidfd, signum)!=0) {
         perror("smash error: kill failed");
     }
-    std::cout << "signal number " << signum << " was sent to pid " << job->pid << std::endl;
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
+    std::cout << "signal number " << signum << " was sent to pid " << job->pid << '\n';
 }
 
 
-UnSetEnvCommand::UnSetEnvCommand(const char *cmd_line): BuiltInCommand(cmd_line) {}
+UnSetEnvCommand::UnSetEnvCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
 
 void UnSetEnvCommand::execute() {
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     if (argc <= 1) {
         std::cerr << ("smash error: unsetenv: not enough arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     pid_t pid = getpid();
     std::string path = "/proc/" + std::to_string(pid) + "/environ";
 
-    int fd = open(path.c_str(), O_RDONLY);
-    if (fd == -1) {
+    std::vector<BatchFileReader::Request> request(1, BatchFileReader::Request(AT_FDCWD, path, 65536));
+    BatchFileReader::instance().read(request);
+    if (request[0].open_error != 0) {
+        errno = request[0].open_error;
         perror("smash error: open failed");
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
-
-    // read file in chunks
-    std::vector<char> buffer;
-    char temp[4096];
-
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, temp, sizeof(temp))) > 0) {
-        buffer.insert(buffer.end(), temp, temp + bytes_read);
-    }
-
-    if (bytes_read == -1) {
+    if (request[0].read_error != 0) {
+        errno = request[0].read_error;
         perror("smash error: read failed");
     }
 
-    close(fd);
-
-    std::string allEnvVar = std::string(buffer.begin(), buffer.end());
+    const std::string& allEnvVar = request[0].data;
 
     for (int k = 1; k < argc; ++k) {
         std::string currentEnvVar = std::string(args[k]);
         if (allEnvVar.find(currentEnvVar + "=") == std::string::npos) {
             std::cerr << (("smash error: unsetenv: " + currentEnvVar + " does not exist").c_str()) << std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         for (int i = 0; __environ[i] != 0; i++) {
@@ -924,13 +3346,147 @@ void UnSetEnvCommand::execute() {
             }
         }
     }
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
+}
+
+
+HashCommand::HashCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
+
+void HashCommand::execute() {
+    int argc = args.size();
+    PathCache &path_cache = SmallShell::getInstance().getPathCache();
+    if (argc == 1) {
+        path_cache.print();
+    }
+    else if (argc == 2 && strcmp(args[1], "-r") == 0) {
+        path_cache.clear();
+    }
+    else {
+        std::cerr << ("smash error: hash: invalid arguments") << std::endl;
+    }
+}
+
+
+TimeoutCommand::TimeoutCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
+
+// one year; longer values are refused rather than wrapped into a shorter timeout
+static const long MAX_TIMEOUT_SECONDS = 365L * 24 * 60 * 60;
+
+void TimeoutCommand::execute() {
+    // timeout [-s signum] <seconds> <command>
+    int argc = args.size();
+    int first = 1;
+    long signum = SIGKILL;
+    char *endptr;
+    errno = 0;
+    if (argc > 1 && strcmp(args[1], "-s") == 0) {
+        signum = argc > 2 ? strtol(args[2], &endptr, 10) : 0;
+        if (signum <= 0 || signum >= NSIG || *endptr != '\0') {
+            std::cerr << ("smash error: timeout: invalid arguments") << std::endl;
+            return;
+        }
+        first = 3;
+    }
+    long seconds = argc > first + 1 ? strtol(args[first], &endptr, 10) : 0;
+    if (seconds <= 0 || seconds > MAX_TIMEOUT_SECONDS || errno == ERANGE || *endptr != '\0') {
+        std::cerr << ("smash error: timeout: invalid arguments") << std::endl;
+        return;
+    }
+    if (!timeoutsAvailable()) {
+        std::cerr << ("smash error: timeout: timers are not available") << std::endl;
+        return;
+    }
+    SmallShell &smash = SmallShell::getInstance();
+    std::unique_ptr<Command> cmd(smash.CreateCommand(skip_words(cmd_line, first + 1)));
+    if (!cmd) {
+        return;
+    }
+    // only a single external process can be signalled; anything else is refused rather than run uncapped
+    if (!cmd->setTimeout(static_cast<unsigned>(seconds), static_cast<int>(signum), cmd_line)) {
+        if (dynamic_cast<PipeCommand *>(cmd.get()) || dynamic_cast<RedirectionCommand *>(cmd.get())) {
+            std::cerr << ("smash error: timeout: cannot time a pipeline or redirection") << std::endl;
+        }
+        else {
+            std::cerr << ("smash error: timeout: cannot time a built-in command") << std::endl;
+        }
+        return;
+    }
+    cmd->execute();
+}
+
+
+StatsCommand::StatsCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
+
+void StatsCommand::execute() {
+    int argc = args.size();
+    SmallShell &smash = SmallShell::getInstance();
+    if (argc == 2 && strcmp(args[1], "-r") == 0) {
+        smash.resetLatency();
+        return;
+    }
+    if (argc != 1) {
+        std::cerr << ("smash error: stats: invalid arguments") << std::endl;
+        return;
+    }
+    std::cout << std::left << std::setw(8) << "phase" << std::right << std::setw(9) << "count"
+              << std::setw(9) << "mean" << std::setw(9) << "p50" << std::setw(9) << "p90"
+              << std::setw(9) << "p99" << std::setw(9) << "max" << '\n';
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        const LatencyHistogram &histogram = smash.getLatency(static_cast<Phase>(i));
+        std::cout << std::left << std::setw(8) << SmallShell::phaseName(static_cast<Phase>(i)) << std::right
+                  << std::setw(9) << histogram.getCount()
+                  << std::setw(9) << format_duration(histogram.getMean())
+                  << std::setw(9) << format_duration(histogram.percentile(0.5))
+                  << std::setw(9) << format_duration(histogram.percentile(0.9))
+                  << std::setw(9) << format_duration(histogram.percentile(0.99))
+                  << std::setw(9) << format_duration(histogram.getMax()) << '\n';
+    }
+    const ParseCache &parse_cache = smash.getParseCache();
+    const PathCache &path_cache = smash.getPathCache();
+    std::cout << "parse cache: " << parse_cache.getHits() << " hits, " << parse_cache.getMisses() << " misses\n"
+              << "path cache: " << path_cache.getHits() << " hits, " << path_cache.getMisses() << " misses\n";
+}
+
+
+TimeCommand::TimeCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
+
+void TimeCommand::execute() {
+    if (args.size() < 2) {
+        std::cerr << ("smash error: time: invalid arguments") << std::endl;
+        return;
+    }
+    SmallShell &smash = SmallShell::getInstance();
+    std::unique_ptr<Command> cmd(smash.CreateCommand(skip_words(cmd_line, 1)));
+    if (!cmd) {
+        return;
     }
+    // a built-in runs inside smash, so its share is smash's own usage
+    struct rusage self_before, self_after;
+    struct timespec start, end;
+    getrusage(RUSAGE_SELF, &self_before);
+    takeForegroundUsage();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cmd->execute();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_after);
+    struct rusage children = takeForegroundUsage();
+
+    long long user = timeval_ns(children.ru_utime) + timeval_ns(self_after.ru_utime) - timeval_ns(self_before.ru_utime);
+    long long sys = timeval_ns(children.ru_stime) + timeval_ns(self_after.ru_stime) - timeval_ns(self_before.ru_stime);
+    long long real = timespec_ns(end) - timespec_ns(start);
+    // laid out like bash's time, on stderr so it stays apart from the command's output
+    std::ostringstream report;
+    report << "\nreal\t" << real / 60000000000LL << 'm' << format_seconds(real % 60000000000LL)
+           << "\nuser\t" << user / 60000000000LL << 'm' << format_seconds(user % 60000000000LL)
+           << "\nsys\t" << sys / 60000000000LL << 'm' << format_seconds(sys % 60000000000LL)
+           << "\nmaxrss\t" << children.ru_maxrss << " KB"
+           << "\ncsw\t" << children.ru_nvcsw + self_after.ru_nvcsw - self_before.ru_nvcsw << " voluntary, "
+           << children.ru_nivcsw + self_after.ru_nivcsw - self_before.ru_nivcsw << " involuntary\n";
+    std::cout.flush();
+    std::cerr << report.str();
 }
 
 
-SysInfoCommand::SysInfoCommand(const char *cmd_line): BuiltInCommand(cmd_line) {}
+SysInfoCommand::SysInfoCommand(const ParsedCommandPtr &parsed): BuiltInCommand(parsed) {}
 
 void SysInfoCommand::execute() {
     struct utsname uts{};
@@ -964,15 +3520,22 @@ void SysInfoCommand::execute() {
         std::strcpy(boot_str, "unknown");
     }
 
-    std::cout << "System: "      << uts.sysname  << std::endl;
-    std::cout << "Hostname: "    << uts.nodename << std::endl;
-    std::cout << "Kernel: "      << uts.release  << std::endl;
-    std::cout << "Architecture: "<< uts.machine  << std::endl;
-    std::cout << "Boot Time: "   << boot_str     << std::endl;
+    std::cout << "System: "      << uts.sysname << '\n';
+    std::cout << "Hostname: "    << uts.nodename << '\n';
+    std::cout << "Kernel: "      << uts.release << '\n';
+    std::cout << "Architecture: "<< uts.machine << '\n';
+    std::cout << "Boot Time: "   << boot_str << '\n';
 
 }
 
-ExternalCommand::ExternalCommand(const char *cmd_line): Command(cmd_line) {}
+ExternalCommand::ExternalCommand(const ParsedCommandPtr &parsed): Command(parsed), job_line(cmd_line) {}
+
+bool ExternalCommand::setTimeout(unsigned seconds, int sig_num, const char *job_line) {
+    timeout_seconds = seconds;
+    timeout_signal = sig_num;
+    this->job_line = job_line;
+    return true;
+}
 
 void ExternalCommand::execute() {
     std::string cmd = std::string(cmd_line);
@@ -990,7 +3553,7 @@ void ExternalCommand::execute() {
 
     bool isComplex = false;
     for (char c : cmd_trimmed) {
-        if (c == '*' || c == '?') {
+        if (c == '*' || c == '?' || c == '[') {
             isComplex = true;
             break;
         }
@@ -999,51 +3562,55 @@ void ExternalCommand::execute() {
     if (cmd_trimmed.empty()) {
         return;
     }
-    int argc = 0;
-    char *args[COMMAND_MAX_ARGS + 1];
-    if (isComplex) {
-        args[0] = strdup("bash");
-        args[1] = strdup("-c");
-        args[2] = strdup(cmd_trimmed.c_str());
-        args[3] = NULL;
-        argc = 3;
-    }
-    else {
-        argc = _parseCommandLine(cmd_trimmed.c_str(), args);
-    }
-
-    if (argc == 0) {
+    if (args.size() == 0) {
         return;
     }
+    char *const *argv = args.argv();
+    char *bash_argv[] = {const_cast<char *>("bash"), const_cast<char *>("-c"),
+                         const_cast<char *>(cmd_trimmed.c_str()), nullptr};
+    std::vector<std::string> words;
+    std::vector<char *> glob_argv;
+    if (isComplex && needs_full_shell(args)) {
+        argv = bash_argv;
+    }
+    else if (isComplex) {
+        // expand the wildcards here and exec the target directly
+        for (int i = 0; i < args.size(); ++i) {
+            if (!has_glob_chars(args[i]) || !glob_expand(args[i], words)) {
+                words.push_back(args[i]);
+            }
+        }
+        for (std::string& word : words) {
+            glob_argv.push_back(&word[0]);
+        }
+        glob_argv.push_back(nullptr);
+        argv = glob_argv.data();
+    }
 
-    pid_t pid = fork();
-
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = spawn_process(argv);
     if (pid == -1) {
-        perror("smash error: fork failed");
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
-
-    if (pid == 0) {
-        setpgrp();
-        execvp(args[0], args);
-        perror("smash error: execvp failed");
-        exit(1);
-    }
+    this->setPID(pid);
+    unsigned long timeout_id = timeout_seconds ? addTimeout(pid, timeout_seconds, timeout_signal, job_line) : 0;
     if (!isBackground) {
-        setForegroundPid(pid);
-        waitpid(pid, NULL, 0);
-        setForegroundPid(0);
+        int status;
+        {
+            PhaseTimer timer(PHASE_WAIT);
+            status = waitForeground(pid);
+        }
+        if (WIFSTOPPED(status)) {
+            SmallShell::getInstance().getJobsList()->addJob(pid, job_line, start, true, timeout_id);
+        }
+        else if (timeout_id) {
+            cancelTimeout(timeout_id);
+        }
     }
     else {
-        this->setPID(pid);
-        SmallShell::getInstance().getJobsList()->addJob(this);
-    }
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
+        SmallShell::getInstance().getJobsList()->addJob(pid, job_line, start, false, timeout_id);
     }
 }
 
@@ -1057,9 +3624,11 @@ AliasMap::~AliasMap() = default;
 
 void AliasMap::addAlias(std::string alias, std::string command) {
     map.insert({alias, command});
+    generation++;
 }
 void AliasMap::removeAlias(std::string alias) {
     map.erase(alias);
+    generation++;
 }
 bool AliasMap::exists(std::string alias) {
     return map.find(alias) != map.end();
@@ -1072,7 +3641,7 @@ std::string AliasMap::getAlias(std::string alias) {
 }
 void AliasMap::printAliases() {
     for (auto & it : map) {
-        std::cout << it.first << "=\'" << it.second << "\'" << std::endl;
+        std::cout << it.first << "=\'" << it.second << "\'\n";
     }
 }
 std::string AliasMap::replaceAlias(const char *cmd_line) {
@@ -1096,15 +3665,11 @@ std::string AliasMap::replaceAlias(const char *cmd_line) {
 
 
 
-AliasCommand::AliasCommand(const char *cmd_line, AliasMap *map) : BuiltInCommand(cmd_line), map(map) {}
+AliasCommand::AliasCommand(const ParsedCommandPtr &parsed, AliasMap *map) : BuiltInCommand(parsed), map(map) {}
 void AliasCommand::execute() {
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     if (argc>2) {
         std::cerr << ("smash error: alias: invalid alias format") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     if (argc == 2) {
@@ -1112,9 +3677,6 @@ void AliasCommand::execute() {
         size_t eq_pos = rest.find('=');
         if (eq_pos == std::string::npos) {
             std::cerr<<("smash error: alias: invalid alias format")<<std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         std::string alias = rest.substr(0, eq_pos);
@@ -1122,59 +3684,28 @@ void AliasCommand::execute() {
         for (char c : alias) {
             if (!std::isalnum(c)&& c!='_') {
                 std::cerr<<("smash error: alias: invalid alias format")<<std::endl;
-                for (int i = 0; i < argc; ++i) {
-                    free(args[i]);
-                }
                 return;
             }
         }
-        if (map->exists(alias)) {
+        if (map->exists(alias) || findBuiltin(alias.data(), alias.size()) != nullptr) {
             std::string error = "smash error: alias: ";
             error += alias;
             error += " already exists or is a reserved command";
             std::cerr << (error.c_str())<<std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
-        std::vector<std::string> reserved = {
-            "chprompt", "showpid", "pwd", "cd", "jobs", "fg", "quit",
-            "kill", "alias", "unalias", "unsetenv", "sysinfo"}; //we may need to check for more
-        for (auto keyword : reserved) {
-            if (alias == keyword) {
-                std::string error = "smash error: alias: ";
-                error += alias;
-                error += " already exists or is a reserved command";
-                std::cerr<< (error.c_str())<<std::endl;
-                for (int i = 0; i < argc; ++i) {
-                    free(args[i]);
-                }
-                return;
-            }
-        }
         map->addAlias(alias, command);
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
     }
     else {
         map->printAliases();
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
     }
 }
 
-UnAliasCommand::UnAliasCommand(const char *cmd_line, AliasMap *map) : BuiltInCommand(cmd_line), map(map) {}
+UnAliasCommand::UnAliasCommand(const ParsedCommandPtr &parsed, AliasMap *map) : BuiltInCommand(parsed), map(map) {}
 void UnAliasCommand::execute() {
-    char *args[COMMAND_MAX_ARGS+1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
     if (argc<2) {
         std::cerr<<("smash error: unalias: not enough arguments")<<std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
     for (int j = 1; j < argc; ++j) {
@@ -1183,37 +3714,27 @@ void UnAliasCommand::execute() {
             error += args[j];
             error += " does not exist";
             std::cerr << (error.c_str()) << std::endl;
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         map->removeAlias(args[j]);
 
     }
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
 
 }
 
 
 
-DiskUsageCommand::DiskUsageCommand(const char *cmd_line)
-    : Command(cmd_line) {}
+DiskUsageCommand::DiskUsageCommand(const ParsedCommandPtr &parsed)
+    : Command(parsed) {}
 
 void DiskUsageCommand::execute() {
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_line, args);
+    int argc = args.size();
 
     std::string path;
 
     if (argc > 2) {
 
         std::cerr << ("smash error: du: too many arguments") << std::endl;
-        for (int i = 0; i < argc; ++i) {
-            free(args[i]);
-        }
         return;
     }
 
@@ -1222,9 +3743,6 @@ void DiskUsageCommand::execute() {
         char cwd[PATH_MAX];
         if (!getcwd(cwd, sizeof(cwd))) {
             perror("smash error: getcwd failed");
-            for (int i = 0; i < argc; ++i) {
-                free(args[i]);
-            }
             return;
         }
         path = cwd;
@@ -1232,33 +3750,31 @@ void DiskUsageCommand::execute() {
         path = args[1];
     }
 
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
 
     unsigned long long total_bytes = 0;
-    if (du_recursive(path, total_bytes) == -1) {
+    DuCache cache;
+    bool use_cache = DuCache::enabled();
+    if (use_cache) {
+        cache.load();
+    }
+    DiskUsageWalker walker(DiskUsageWalker::defaultThreadCount(), use_cache ? &cache : nullptr);
+    if (walker.run(path, total_bytes) == -1) {
 
         return;
     }
 
     unsigned long long total_kb = (total_bytes + 1023ULL) / 1024ULL;
 
-    std::cout << "Total disk usage: " << total_kb << " KB" << std::endl;
+    std::cout << "Total disk usage: " << total_kb << " KB" << '\n';
 }
 
 
-WhoAmICommand::WhoAmICommand(const char *cmd_line)
-    : Command(cmd_line) {}
+WhoAmICommand::WhoAmICommand(const ParsedCommandPtr &parsed)
+    : Command(parsed) {}
 
 
 void WhoAmICommand::execute() {
-    // Parse and immediately free args – they are ignored by spec
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_line, args);
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
+    // args are ignored by spec
 
     uid_t uid = getuid();
     gid_t gid = getgid();
@@ -1272,105 +3788,31 @@ void WhoAmICommand::execute() {
         return;
     }
 
-    std::cout << uid << std::endl;
-    std::cout << gid << std::endl;
-    std::cout << pw.pw_name << " " << pw.pw_dir << std::endl;
+    std::cout << uid << '\n';
+    std::cout << gid << '\n';
+    std::cout << pw.pw_name << " " << pw.pw_dir << '\n';
 }
 
 
-USBInfoCommand::USBInfoCommand(const char *cmd_line)
-    : Command(cmd_line) {}
+USBInfoCommand::USBInfoCommand(const ParsedCommandPtr &parsed)
+    : Command(parsed) {}
 
 
 void USBInfoCommand::execute() {
-    // Ignore any arguments (but free them)
-    char *args[COMMAND_MAX_ARGS + 1];
-    int argc = _parseCommandLine(cmd_line, args);
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
-
-    const std::string base = "/sys/bus/usb/devices";
+    // Ignore any arguments
 
-    std::vector<std::string> entries;
-    if (!list_dir_entries(base, entries)) {
+    const std::vector<UsbDeviceInfo> *table = UsbDeviceTable::instance().get();
+    if (table == nullptr) {
         perror("smash error: open failed");
         return;
     }
-
-    std::vector<UsbDeviceInfo> devices;
-
-    for (const auto& name : entries) {
-        std::string devpath = base + "/" + name;
-
-        // devnum tells us it's a "real" USB device
-        std::string devnum_str;
-        if (!read_first_line(devpath + "/devnum", devnum_str)) {
-            continue; // not a real device directory
-        }
-
-        char* endptr = nullptr;
-        long devnum = strtol(devnum_str.c_str(), &endptr, 10);
-        if (endptr == devnum_str.c_str() || devnum <= 0) {
-            continue; // malformed devnum
-        }
-
-        UsbDeviceInfo info{};
-        info.devnum = (int)devnum;
-
-        std::string vendor, product, manu, prodname;
-
-        if (!read_first_line(devpath + "/idVendor", vendor))
-            vendor = "N/A";
-        if (!read_first_line(devpath + "/idProduct", product))
-            product = "N/A";
-        if (!read_first_line(devpath + "/manufacturer", manu))
-            manu = "N/A";
-        if (!read_first_line(devpath + "/product", prodname))
-            prodname = "N/A";
-
-        info.vendor = vendor;
-        info.product = product;
-        info.manufacturer = manu;
-        info.product_name = prodname;
-
-        // Max power: try bMaxPower, then power/max_power
-        std::string mp;
-        if (!read_first_line(devpath + "/bMaxPower", mp)) {
-            read_first_line(devpath + "/power/max_power", mp);
-        }
-
-        if (mp.empty()) {
-            info.max_power = "N/A";
-        } else {
-            // Extract digits only
-            std::string digits;
-            for (char c : mp) {
-                if (isdigit((unsigned char)c)) {
-                    digits.push_back(c);
-                }
-            }
-            if (digits.empty()) {
-                info.max_power = "N/A";
-            } else {
-                info.max_power = digits; // we'll add "mA" on print
-            }
-        }
-
-        devices.push_back(info);
-    }
+    const std::vector<UsbDeviceInfo>& devices = *table;
 
     if (devices.empty()) {
         std::cerr<<("smash error: usbinfo: no USB devices found")<<std::endl;
         return;
     }
 
-    // sort by devnum ascending
-    std::sort(devices.begin(), devices.end(),
-              [](const UsbDeviceInfo& a, const UsbDeviceInfo& b) {
-                  return a.devnum < b.devnum;
-              });
-
     for (const auto& d : devices) {
         std::cout << "Device " << d.devnum << ": ID "
                   << d.vendor << ":" << d.product << " "
@@ -1382,6 +3824,6 @@ void USBInfoCommand::execute() {
         } else {
             std::cout << d.max_power << "mA";
         }
-        std::cout << std::endl;
+        std::cout << '\n';
     }
 }
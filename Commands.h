@@ -1,23 +1,107 @@
 // Ver: 04-11-2025
 #ifndef SMASH_COMMAND_H_
 #define SMASH_COMMAND_H_
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
+#include <sys/resource.h>
+#include <time.h>
 
 #define COMMAND_MAX_LENGTH (200)
-#define COMMAND_MAX_ARGS (20)
+
+/**
+ * Splits a command line into whitespace separated arguments.
+ * The line is copied once into an internal buffer and every token is a
+ * NUL-terminated slice of that buffer, so the argument count is unbounded and
+ * nothing has to be freed by the caller. argv() is suitable for execvp.
+ */
+class CommandArgs {
+private:
+    std::string buffer;
+    std::vector<char *> args;
+public:
+    explicit CommandArgs(const char *cmd_line);
+
+    CommandArgs(CommandArgs const &) = delete; // tokens point into buffer
+    void operator=(CommandArgs const &) = delete;
+
+    int size() const {
+        return static_cast<int>(args.size()) - 1;
+    }
+
+    char *operator[](int i) const {
+        return args[i];
+    }
+
+    char *const *argv() const {
+        return args.data();
+    }
+
+    // removes a trailing background sign ("cmd &" or "cmd&"), returns true if one was found
+    bool stripBackground();
+};
+
+enum CommandKind {
+    KIND_EXTERNAL, KIND_REDIRECTION, KIND_PIPE, KIND_BUILTIN
+};
+
+struct BuiltinEntry;
+
+/**
+ * What CreateCommand and the compound commands learn from one (alias expanded) line.
+ * It is built once per distinct line and shared by every Command created from it,
+ * so nothing changes after construction.
+ */
+struct ParsedCommand {
+    CommandKind kind = KIND_EXTERNAL;
+    std::string line; // alias expanded and trimmed
+    // the tokens of line, that Commands use as their args; external commands do not see the
+    // background sign, they tell a background line from `line` itself
+    CommandArgs args;
+    const BuiltinEntry *builtin = nullptr; // set for KIND_BUILTIN
+    // redirection "inner > target" or "inner >> target"; valid is false for a malformed one
+    bool valid = true;
+    bool append = false;
+    std::string target;
+    std::string inner;
+    // the tokens of every pipeline stage, or of the inner command of a redirection;
+    // out_targets[i] is the fd pipeline stage i writes into the pipe
+    std::deque<CommandArgs> stages;
+    std::vector<std::string> stage_lines;
+    std::vector<int> out_targets;
+
+    explicit ParsedCommand(const std::string &expanded_line);
+};
+
+typedef std::shared_ptr<const ParsedCommand> ParsedCommandPtr;
 
 class Command {
 protected:
-    const char *cmd_line;
+    const char *cmd_line; // not owned, points into the line of `parsed`
+    const CommandArgs &args; // tokenized once per distinct line, owned by `parsed`
     pid_t pid = 0;
+    ParsedCommandPtr parsed; // keeps cmd_line alive
 public:
-    Command(const char *cmd_line);
+    explicit Command(const ParsedCommandPtr &parsed);
 
     virtual ~Command();
 
     virtual void execute() = 0;
 
+    // sends sig_num to the started process after `seconds`; it is listed and reported as
+    // job_line. Only external commands start a process of their own, others return false
+    virtual bool setTimeout(unsigned seconds, int sig_num, const char *job_line) {
+        return false;
+    }
+
+    // commands are short lived, they come from a pool of fixed size slots (see CommandPool)
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
+
     //virtual void prepare();
     //virtual void cleanup();
     std::string getCMD() const {
@@ -34,19 +118,25 @@ public:
 class BuiltInCommand : public Command {
 
 public:
-    BuiltInCommand(const char *cmd_line);
+    BuiltInCommand(const ParsedCommandPtr &parsed);
 
     virtual ~BuiltInCommand() {
     }
 };
 
 class ExternalCommand : public Command {
+private:
+    unsigned timeout_seconds = 0; // 0 for no timeout
+    int timeout_signal = 0;
+    const char *job_line; // not owned, the timeout command outlives this one
 public:
-    ExternalCommand(const char *cmd_line);
+    ExternalCommand(const ParsedCommandPtr &parsed);
 
     virtual ~ExternalCommand() {
     }
 
+    bool setTimeout(unsigned seconds, int sig_num, const char *job_line) override;
+
     void execute() override;
 
 };
@@ -55,9 +145,8 @@ public:
 
 
 class RedirectionCommand : public Command {
-    // TODO: Add your data members
 public:
-    explicit RedirectionCommand(const char *cmd_line);
+    explicit RedirectionCommand(const ParsedCommandPtr &parsed);
 
     virtual ~RedirectionCommand() {
     }
@@ -66,9 +155,8 @@ public:
 };
 
 class PipeCommand : public Command {
-    // TODO: Add your data members
 public:
-    PipeCommand(const char *cmd_line);
+    explicit PipeCommand(const ParsedCommandPtr &parsed);
 
     virtual ~PipeCommand() {
     }
@@ -78,7 +166,7 @@ public:
 
 class DiskUsageCommand : public Command {
 public:
-    DiskUsageCommand(const char *cmd_line);
+    DiskUsageCommand(const ParsedCommandPtr &parsed);
 
     virtual ~DiskUsageCommand() {
     }
@@ -88,7 +176,7 @@ public:
 
 class WhoAmICommand : public Command {
 public:
-    WhoAmICommand(const char *cmd_line);
+    WhoAmICommand(const ParsedCommandPtr &parsed);
 
     virtual ~WhoAmICommand() {
     }
@@ -97,16 +185,8 @@ public:
 };
 
 class USBInfoCommand : public Command {
-    struct UsbDeviceInfo {
-        int devnum;
-        std::string vendor;
-        std::string product;
-        std::string manufacturer;
-        std::string product_name;
-        std::string max_power; // just the number or "N/A"
-    };
 public:
-    USBInfoCommand(const char *cmd_line);
+    USBInfoCommand(const ParsedCommandPtr &parsed);
 
     virtual ~USBInfoCommand() {
     }
@@ -117,7 +197,7 @@ public:
 class ChangeDirCommand : public BuiltInCommand {
     // TODO: Add your data members public:
 public:
-    ChangeDirCommand(const char *cmd_line);
+    ChangeDirCommand(const ParsedCommandPtr &parsed);
 
     virtual ~ChangeDirCommand() {
     }
@@ -128,7 +208,7 @@ public:
 class ChangePromptCommand : public BuiltInCommand {
 
 public:
-    explicit ChangePromptCommand(const char *cmd_line);
+    explicit ChangePromptCommand(const ParsedCommandPtr &parsed);
 
     virtual ~ChangePromptCommand() = default;
 
@@ -137,7 +217,7 @@ public:
 
 class GetCurrDirCommand : public BuiltInCommand {
 public:
-    GetCurrDirCommand(const char *cmd_line);
+    GetCurrDirCommand(const ParsedCommandPtr &parsed);
 
     virtual ~GetCurrDirCommand() {
     }
@@ -147,7 +227,7 @@ public:
 
 class ShowPidCommand : public BuiltInCommand {
 public:
-    ShowPidCommand(const char *cmd_line);
+    ShowPidCommand(const ParsedCommandPtr &parsed);
 
     virtual ~ShowPidCommand() {
     }
@@ -161,7 +241,7 @@ class QuitCommand : public BuiltInCommand {
 private:
     JobsList* jobs;
 public:
-    QuitCommand(const char *cmd_line, JobsList *jobs);
+    QuitCommand(const ParsedCommandPtr &parsed, JobsList *jobs);
 
     virtual ~QuitCommand() {
     }
@@ -177,22 +257,60 @@ public:
         pid_t pid;
         bool is_stopped;
         std::string cmd_line;
+        int pidfd = -1; // signals and exit notification without pid reuse races, -1 if unsupported
+        unsigned long timeout_id = 0; // the timeout armed for this job (see addTimeout), 0 if none
+        // CLOCK_MONOTONIC spawn and reap times (jobs are reaped between commands, so end can
+        // trail the exit a little); end, status and usage are set once it is reaped
+        struct timespec start{};
+        struct timespec end{};
+        int status = 0;
+        struct rusage usage{};
+        int prev = -1; // neighbouring slots in job-id order, -1 at the ends
+        int next = -1;
 
         JobEntry(int job_id, pid_t pid, const std::string& cmd_line,bool is_stopped = false) : job_id(job_id), pid(pid),is_stopped(is_stopped), cmd_line(cmd_line) {}
     };
 
 private:
-    std::vector<JobEntry *> jobs;
+    // open-addressing map from a positive int key (job id or pid) to a slot number
+    class SlotIndex {
+    private:
+        std::vector<std::pair<int, int> > table; // (key, slot), key 0 marks an empty bucket
+        int used = 0;
+        size_t bucket(int key) const;
+        void grow();
+    public:
+        int find(int key) const; // -1 if missing
+        void insert(int key, int slot);
+        void erase(int key);
+    };
+
+    std::deque<JobEntry> slots; // deque keeps JobEntry addresses stable as it grows
+    std::vector<int> free_slots;
+    SlotIndex by_id;
+    SlotIndex by_pid;
+    int head = -1; // oldest job; ids only grow, so new jobs are linked at the tail
+    int tail = -1;
+    int count = 0;
+    int stopped_count = 0;
     int max_job_id;
+    int pidfd_epoll; // every job pidfd, tagged with its slot, reports exits in one epoll_wait
+    int pidfd_jobs = 0;
+    std::deque<JobEntry> finished; // the most recently reaped jobs, oldest first
+
+    void removeSlot(int slot);
+    void finishSlot(int slot, int status, const struct rusage &usage);
 public:
 
     JobsList();
 
     ~JobsList();
 
-    void addJob(Command *cmd, bool isStopped = false);
+    void addJob(pid_t pid, const std::string &cmd_line, const struct timespec &start, bool isStopped = false,
+                unsigned long timeout_id = 0);
 
-    void printJobsList();
+    // with long_format, also the state, run time and pid of every job and the finished ones
+    void printJobsList(bool long_format = false);
 
     void killAllJobs();
 
@@ -200,18 +318,25 @@ public:
 
     JobEntry *getJobById(int jobId);
 
+    JobEntry *getJobByPid(pid_t pid);
+
     void removeJobById(int jobId);
 
+    // removes a job that was reaped elsewhere (by fg), keeping it in the finished history
+    void finishJob(int jobId, int status, const struct rusage &usage);
+
+    void setJobStopped(int jobId, bool stopped);
+
     JobEntry *getLastJob(int *lastJobId);
 
     JobEntry *getLastStoppedJob(int *jobId);
 
     bool isEmpty() {
-        return jobs.empty();
+        return count == 0;
     }
 
     int getJobCount() {
-        return jobs.size();
+        return count;
     }
     // TODO: Add extra methods or modify exisitng ones as needed
 };
@@ -220,7 +345,7 @@ class JobsCommand : public BuiltInCommand {
 private:
     JobsList *jobs;
 public:
-    JobsCommand(const char *cmd_line, JobsList *jobs);
+    JobsCommand(const ParsedCommandPtr &parsed, JobsList *jobs);
 
     virtual ~JobsCommand() {
     }
@@ -231,7 +356,7 @@ public:
 class KillCommand : public BuiltInCommand {
     JobsList* jobs;
 public:
-    KillCommand(const char *cmd_line, JobsList *jobs);
+    KillCommand(const ParsedCommandPtr &parsed, JobsList *jobs);
 
     virtual ~KillCommand() {
     }
@@ -243,7 +368,7 @@ class ForegroundCommand : public BuiltInCommand {
 private:
     JobsList *jobs;
 public:
-    ForegroundCommand(const char *cmd_line, JobsList *jobs);
+    ForegroundCommand(const ParsedCommandPtr &parsed, JobsList *jobs);
 
     virtual ~ForegroundCommand() {
     }
@@ -254,9 +379,13 @@ public:
 class AliasMap {
 private:
     std::map<std::string, std::string> map;
+    unsigned long generation = 0; // bumped on every change, parses made before are stale
 public:
     AliasMap();
     ~AliasMap();
+    unsigned long getGeneration() const {
+        return generation;
+    }
     void addAlias(std::string alias, std::string command);
     void removeAlias(std::string alias);
     bool exists(std::string alias);
@@ -269,7 +398,7 @@ class AliasCommand : public BuiltInCommand {
 private:
     AliasMap* map;
 public:
-    AliasCommand(const char *cmd_line, AliasMap* map);
+    AliasCommand(const ParsedCommandPtr &parsed, AliasMap* map);
 
     virtual ~AliasCommand() {
     }
@@ -281,7 +410,7 @@ class UnAliasCommand : public BuiltInCommand {
 private:
     AliasMap* map;
 public:
-    UnAliasCommand(const char *cmd_line, AliasMap* map);
+    UnAliasCommand(const ParsedCommandPtr &parsed, AliasMap* map);
 
     virtual ~UnAliasCommand() {
     }
@@ -291,7 +420,7 @@ public:
 
 class UnSetEnvCommand : public BuiltInCommand {
 public:
-    UnSetEnvCommand(const char *cmd_line);
+    UnSetEnvCommand(const ParsedCommandPtr &parsed);
 
     virtual ~UnSetEnvCommand() {
     }
@@ -299,9 +428,49 @@ public:
     void execute() override;
 };
 
+class HashCommand : public BuiltInCommand {
+public:
+    HashCommand(const ParsedCommandPtr &parsed);
+
+    virtual ~HashCommand() {
+    }
+
+    void execute() override;
+};
+
+class TimeoutCommand : public BuiltInCommand {
+public:
+    TimeoutCommand(const ParsedCommandPtr &parsed);
+
+    virtual ~TimeoutCommand() {
+    }
+
+    void execute() override;
+};
+
+class StatsCommand : public BuiltInCommand {
+public:
+    StatsCommand(const ParsedCommandPtr &parsed);
+
+    virtual ~StatsCommand() {
+    }
+
+    void execute() override;
+};
+
+class TimeCommand : public BuiltInCommand {
+public:
+    TimeCommand(const ParsedCommandPtr &parsed);
+
+    virtual ~TimeCommand() {
+    }
+
+    void execute() override;
+};
+
 class SysInfoCommand : public BuiltInCommand {
 public:
-    SysInfoCommand(const char *cmd_line);
+    SysInfoCommand(const ParsedCommandPtr &parsed);
 
     virtual ~SysInfoCommand() {
     }
@@ -313,6 +482,142 @@ public:
 
 
 
+typedef Command *(*CommandFactory)(const ParsedCommandPtr &parsed, JobsList *jobs, AliasMap *aliases);
+
+// how a built-in runs as a pipeline stage
+enum StageMode {
+    STAGE_IN_SHELL, // only writes output, so it runs inside smash
+    STAGE_SUBSHELL, // changes shell state, so it runs in a forked child like bash's subshell
+    STAGE_REFUSED // waits for processes or takes the terminal, not allowed in a pipeline
+};
+
+// one row of the compile-time built-in registry, see findBuiltin
+struct BuiltinEntry {
+    const char *name;
+    CommandFactory factory;
+    StageMode stage_mode;
+};
+
+// the built-in command called name[0, length), nullptr if there is none
+const BuiltinEntry *findBuiltin(const char *name, size_t length);
+
+/**
+ * LRU cache of parsed command lines, keyed by the raw line. An entry is only
+ * used while the alias map is at the generation it was parsed with.
+ */
+class ParseCache {
+private:
+    struct Entry {
+        std::string raw_line;
+        unsigned long generation;
+        std::shared_ptr<const ParsedCommand> parsed;
+    };
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t capacity;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+public:
+    explicit ParseCache(size_t capacity);
+
+    std::shared_ptr<const ParsedCommand> get(const char *cmd_line, AliasMap &aliases);
+
+    unsigned long getHits() const {
+        return hits;
+    }
+    unsigned long getMisses() const {
+        return misses;
+    }
+};
+
+/**
+ * Executable lookup cache (like bash's hash table): a command name is searched in $PATH
+ * once and later spawns exec the remembered absolute path. The whole table is dropped
+ * when PATH changes, a single entry when exec'ing it fails. Names looked up past a
+ * relative PATH entry ("" or ".") depend on the cwd and are not remembered, so nothing found
+ * at or after such an entry is ever cached (PATH=.:/usr/bin caches nothing); hash says so.
+ */
+class PathCache {
+private:
+    struct Entry {
+        std::string path;
+        unsigned long hits;
+    };
+    std::unordered_map<std::string, Entry> entries;
+    std::string search_path; // the PATH the entries were resolved with
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+public:
+    // the absolute path of name, false if name has a '/' or is not found in PATH
+    bool resolve(const char *name, std::string &path);
+    void forget(const char *name);
+    void clear();
+    void print() const;
+
+    unsigned long getHits() const {
+        return hits;
+    }
+    unsigned long getMisses() const {
+        return misses;
+    }
+};
+
+// the parts of a command's life that are timed, PHASE_COMMAND being the whole of it
+enum Phase {
+    PHASE_ALIAS, PHASE_PARSE, PHASE_JOBS, PHASE_SPAWN, PHASE_WAIT, PHASE_COMMAND, PHASE_COUNT
+};
+
+/**
+ * Latency histogram with HDR style log buckets: values below 32ns get a bucket each,
+ * and every higher power of two is split into 16 linear sub-buckets, so any value is
+ * kept to within 1/16 of itself. Recording is a few shifts and an increment.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = 61 * SUB_BUCKETS; // up to 2^64 ns
+private:
+    unsigned long counts[BUCKETS] = {};
+    unsigned long count = 0;
+    unsigned long long total = 0;
+    unsigned long long max = 0;
+public:
+    void record(unsigned long long ns);
+    // the largest value counted in bucket
+    static unsigned long long bucketLimit(int bucket);
+    // the value p (0..1) of the recorded values are at or below, within the bucket precision
+    unsigned long long percentile(double p) const;
+
+    unsigned long getCount() const {
+        return count;
+    }
+    unsigned long long getMean() const {
+        return count ? total / count : 0;
+    }
+    unsigned long long getMax() const {
+        return max;
+    }
+    unsigned long getBucket(int bucket) const {
+        return counts[bucket];
+    }
+};
+
+/**
+ * Times a phase from construction to destruction with CLOCK_MONOTONIC and records it
+ * in the shell's histogram of that phase. Cheap enough (two vDSO clock reads) to stay on.
+ */
+class PhaseTimer {
+private:
+    Phase phase;
+    struct timespec start;
+public:
+    explicit PhaseTimer(Phase phase);
+    ~PhaseTimer();
+
+    PhaseTimer(PhaseTimer const &) = delete;
+    void operator=(PhaseTimer const &) = delete;
+};
+
 //small shell class --------------------------------------------------------------------
 
 class SmallShell {
@@ -322,6 +627,9 @@ private:
     std::string last_dir;
     JobsList *job_list;
     AliasMap *alias_map;
+    ParseCache parse_cache;
+    PathCache path_cache;
+    LatencyHistogram latency[PHASE_COUNT];
     SmallShell();
 
 public:
@@ -349,6 +657,25 @@ public:
     void setLastDir(const std::string &last_dir);
 
     JobsList *getJobsList() const;
+
+    const ParseCache &getParseCache() const {
+        return parse_cache;
+    }
+
+    PathCache &getPathCache() {
+        return path_cache;
+    }
+
+    LatencyHistogram &getLatency(Phase phase) {
+        return latency[phase];
+    }
+
+    static const char *phaseName(Phase phase);
+
+    void resetLatency();
+
+    // writes the histograms and cache counters as JSON to $SMASH_STATS_JSON, if it is set
+    void dumpStats();
 };
 
 #endif //SMASH_COMMAND_H_
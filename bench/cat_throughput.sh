@@ -0,0 +1,61 @@
+#!/bin/bash
+# Measures smash's cat forwarding (copy_fd for "cat f > out", the file handed over as stdin
+# for "cat f | ...") against the spawned cat it replaces.
+# smash only forwards when the command is literally "cat", so the baseline runs the same
+# lines with cat's full path, which goes through the normal spawn.
+#
+# usage: bench/cat_throughput.sh [size_mb] [dir]
+#   size_mb  size of the test file, default 2048
+#   dir      where the test file and the copy go, default $TMPDIR or /tmp
+# SMASH (default ./smash) and RUNS (default 3, best run reported) can be overridden.
+
+set -e
+
+SIZE_MB=${1:-2048}
+DIR=${2:-${TMPDIR:-/tmp}}
+SMASH=${SMASH:-./smash}
+RUNS=${RUNS:-3}
+CAT=$(command -v cat)
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+
+BIG="$DIR/smash_cat_bench.in"
+OUT="$DIR/smash_cat_bench.out"
+trap 'rm -f "$BIG" "$OUT"' EXIT
+
+echo "creating a ${SIZE_MB} MB test file in $DIR"
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/urandom > "$BIG"
+cat "$BIG" > /dev/null # start every run with the file in the page cache
+
+# best wall time in ms over RUNS runs of one smash command line
+best_ms() {
+    local best=""
+    for _ in $(seq "$RUNS"); do
+        rm -f "$OUT"
+        local start end
+        start=$(date +%s%N)
+        printf '%s\n' "$1" | "$SMASH" > /dev/null
+        end=$(date +%s%N)
+        local ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+report() {
+    local ms
+    ms=$(best_ms "$2")
+    [ "$ms" -gt 0 ] || ms=1
+    printf '%-28s %8d ms %10d MB/s\n' "$1" "$ms" "$((SIZE_MB * 1000 / ms))"
+}
+
+report "cat > out (copy_fd)" "cat $BIG > $OUT"
+cmp -s "$BIG" "$OUT" || { echo "copy differs from the input" >&2; exit 1; }
+report "cat > out (spawned cat)" "$CAT $BIG > $OUT"
+report "cat | wc -c (forwarded)" "cat $BIG | wc -c"
+report "cat | wc -c (spawned cat)" "$CAT $BIG | wc -c"
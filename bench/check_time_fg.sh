@@ -0,0 +1,37 @@
+#!/bin/bash
+# Checks that "time fg" reports the usage of the job it brings back, which the Makefile tests
+# cannot: time reports on stderr and the usage is not deterministic. A background job burns
+# CPU, then time fg must report at least MIN_USER_MS of user time and a non-zero max RSS.
+#
+# usage: bench/check_time_fg.sh
+# SMASH (default ./smash) and MIN_USER_MS (default 200) can be overridden.
+
+set -e
+
+SMASH=${SMASH:-./smash}
+MIN_USER_MS=${MIN_USER_MS:-200}
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+
+BURN=$(mktemp)
+trap 'rm -f "$BURN"' EXIT
+cat > "$BURN" <<'EOF'
+#!/bin/bash
+i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done
+EOF
+chmod +x "$BURN"
+
+report=$(printf '%s&\ntime fg\n' "$BURN" | "$SMASH" 2>&1 >/dev/null)
+user=$(echo "$report" | awk '$1 == "user" { print $2 }')
+maxrss=$(echo "$report" | awk '$1 == "maxrss" { print $2 }')
+# user is laid out like bash's time: <minutes>m<seconds>.<millis>s
+user_ms=$(echo "$user" | awk -F'[ms]' '{ printf "%d", ($1 * 60 + $2) * 1000 }')
+
+if [ -z "$user_ms" ] || [ "$user_ms" -lt "$MIN_USER_MS" ] || [ "${maxrss:-0}" -le 0 ]; then
+    echo "time fg: FAILED (user $user, maxrss ${maxrss:-?} KB)"
+    exit 1
+fi
+echo "time fg: PASSED (user $user, maxrss $maxrss KB)"
@@ -0,0 +1,50 @@
+#!/bin/bash
+# Shows that smash's memory stays flat with the number of commands it runs: feeds it
+# built-in lines (chprompt with a new prompt on every line, so the parse cache keeps
+# turning over, plus pwd, showpid and jobs) and reports the max RSS for each line count,
+# once read from stdin and once as a -f script. The max RSS comes from smash's own time
+# built-in, run in an outer smash; it includes the RSS the outer smash had when it spawned
+# the inner one, a floor of a few MB.
+#
+# usage: bench/command_memory.sh [lines...]
+#   lines  line counts to run, default 10000 100000 1000000
+# SMASH (default ./smash) can be overridden.
+
+set -e
+
+SMASH=${SMASH:-./smash}
+COUNTS=${*:-10000 100000 1000000}
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+SMASH=$(cd "$(dirname "$SMASH")" && pwd)/$(basename "$SMASH")
+
+INPUT=$(mktemp)
+FROM_STDIN=$(mktemp)
+trap 'rm -f "$INPUT" "$FROM_STDIN"' EXIT
+# smash takes no quoted arguments from time, so the stdin run goes through a script
+printf '#!/bin/sh\nexec %s < %s\n' "$SMASH" "$INPUT" > "$FROM_STDIN"
+chmod +x "$FROM_STDIN"
+
+# max RSS in KB of the command line $1, as the time built-in reports it on stderr
+maxrss_kb() {
+    printf 'time %s\n' "$1" | "$SMASH" 2>&1 >/dev/null | awk '$1 == "maxrss" { print $2 }'
+}
+
+printf '%10s %14s %14s\n' "lines" "stdin" "-f script"
+for count in $COUNTS; do
+    awk -v n="$count" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            k = i % 4
+            if (k == 0) print "chprompt p" i
+            else if (k == 1) print "pwd"
+            else if (k == 2) print "showpid"
+            else print "jobs"
+        }
+    }' > "$INPUT"
+    stdin_kb=$(maxrss_kb "$FROM_STDIN")
+    script_kb=$(maxrss_kb "$SMASH -f $INPUT")
+    printf '%10d %11s KB %11s KB\n' "$count" "$stdin_kb" "$script_kb"
+done
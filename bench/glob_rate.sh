@@ -0,0 +1,81 @@
+#!/bin/bash
+# Times wildcard lines expanded natively against the bash -c path they used to take. The
+# bash -c smash is built from BASELINE, the commit before native glob expansion. Both run
+# LINES lines of "ls *.txt sub*/*.c" in a directory of FILES .txt files and a few
+# subdirectories of .c files, and must print the same listing.
+#
+# usage: bench/glob_rate.sh [lines] [files]
+#   lines  number of wildcard lines, default 2000
+#   files  number of .txt files, default 200
+# SMASH (default ./smash), BASELINE (default df58acd^) and RUNS (default 3, best run
+# reported) can be overridden.
+
+set -e
+
+LINES=${1:-2000}
+FILES=${2:-200}
+SMASH=${SMASH:-./smash}
+BASELINE=${BASELINE:-df58acd^}
+RUNS=${RUNS:-3}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+SMASH=$(cd "$(dirname "$SMASH")" && pwd)/$(basename "$SMASH")
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+echo "building the bash -c smash from $BASELINE"
+mkdir "$WORK/baseline"
+git -C "$SRC" archive "$BASELINE" | tar -x -C "$WORK/baseline"
+g++ --std=c++11 -pthread "$WORK/baseline/Commands.cpp" "$WORK/baseline/signals.cpp" \
+    "$WORK/baseline/smash.cpp" -o "$WORK/smash_bash"
+
+mkdir "$WORK/tree"
+for i in $(seq "$FILES"); do
+    : > "$WORK/tree/f$i.txt"
+    : > "$WORK/tree/f$i.log"
+done
+for d in 1 2 3 4; do
+    mkdir "$WORK/tree/sub$d"
+    for i in $(seq 20); do
+        : > "$WORK/tree/sub$d/s$i.c"
+    done
+done
+{
+    echo "cd $WORK/tree"
+    for _ in $(seq "$LINES"); do
+        echo "ls *.txt sub*/*.c"
+    done
+} > "$WORK/input"
+
+# best wall time in ms over RUNS runs of the input with smash $1, whose output goes to $2
+best_ms() {
+    local best=""
+    for _ in $(seq "$RUNS"); do
+        local start end
+        start=$(date +%s%N)
+        "$1" < "$WORK/input" > "$2"
+        end=$(date +%s%N)
+        local ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+report() {
+    local ms
+    ms=$(best_ms "$2" "$3")
+    [ "$ms" -gt 0 ] || ms=1
+    printf '%-10s %8d ms %8d lines/s\n' "$1" "$ms" "$((LINES * 1000 / ms))"
+}
+
+echo "$LINES x 'ls *.txt sub*/*.c', $FILES .txt files"
+report "bash -c" "$WORK/smash_bash" "$WORK/out.bash"
+report "native" "$SMASH" "$WORK/out.native"
+cmp -s "$WORK/out.bash" "$WORK/out.native" || { echo "the two listings differ" >&2; exit 1; }
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Counts the write syscalls smash makes to print "jobs" with JOBS background jobs, with
+# the batched built-in output and without it. The unbatched smash is built from BASELINE,
+# the commit before output batching. smash's own write count (syscw in /proc/<pid>/io) is
+# read right before and after jobs by a helper script, whose $PPID is smash. The
+# difference also holds the two prompts printed in between.
+#
+# usage: bench/jobs_writes.sh [jobs]
+#   jobs  number of background jobs, default 1000
+# SMASH (default ./smash) and BASELINE (default 8f27ee4^) can be overridden.
+
+set -e
+
+JOBS=${1:-1000}
+SMASH=${SMASH:-./smash}
+BASELINE=${BASELINE:-8f27ee4^}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+echo "building the unbatched smash from $BASELINE"
+mkdir "$WORK/baseline"
+git -C "$SRC" archive "$BASELINE" | tar -x -C "$WORK/baseline"
+g++ --std=c++11 -pthread "$WORK/baseline/Commands.cpp" "$WORK/baseline/signals.cpp" \
+    "$WORK/baseline/smash.cpp" -o "$WORK/smash_unbatched"
+
+printf '#!/bin/sh\ngrep syscw /proc/$PPID/io\n' > "$WORK/syscw"
+chmod +x "$WORK/syscw"
+
+{
+    for _ in $(seq "$JOBS"); do
+        echo "sleep 1000&"
+    done
+    echo "$WORK/syscw"
+    echo "jobs"
+    echo "$WORK/syscw"
+    echo "quit kill"
+} > "$WORK/input"
+
+# write syscalls smash $1 made between the two syscw lines
+writes() {
+    "$1" < "$WORK/input" 2>/dev/null | grep -o 'syscw: [0-9]*' | awk '{ w[NR] = $2 } END { print w[2] - w[1] }'
+}
+
+echo "jobs with $JOBS entries, write syscalls:"
+printf '%-12s %8d\n' "unbatched" "$(writes "$WORK/smash_unbatched")"
+printf '%-12s %8d\n' "batched" "$(writes "$SMASH")"
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Measures how many external commands per second smash starts with each spawn backend:
+# posix_spawnp (the default) and fork + execvp (SMASH_SPAWN=fork). The script feeds LINES
+# lines of COMMAND; both backends run the same input.
+#
+# usage: bench/spawn_rate.sh [lines] [command]
+#   lines    number of command lines, default 3000
+#   command  the line to run, default "true"
+# SMASH (default ./smash) and RUNS (default 3, best run reported) can be overridden.
+
+set -e
+
+LINES=${1:-3000}
+COMMAND=${2:-true}
+SMASH=${SMASH:-./smash}
+RUNS=${RUNS:-3}
+
+if [ ! -x "$SMASH" ]; then
+    echo "$SMASH not found, run make first" >&2
+    exit 1
+fi
+
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+yes "$COMMAND" | head -n "$LINES" > "$INPUT"
+
+# best wall time in ms over RUNS runs of the input, with SMASH_SPAWN set to $1
+best_ms() {
+    local best=""
+    for _ in $(seq "$RUNS"); do
+        local start end
+        start=$(date +%s%N)
+        SMASH_SPAWN=$1 "$SMASH" < "$INPUT" > /dev/null
+        end=$(date +%s%N)
+        local ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+report() {
+    local ms
+    ms=$(best_ms "$2")
+    [ "$ms" -gt 0 ] || ms=1
+    printf '%-16s %8d ms %8d commands/s\n' "$1" "$ms" "$((LINES * 1000 / ms))"
+}
+
+echo "$LINES x '$COMMAND'"
+report "posix_spawnp" posix
+report "fork + execvp" fork
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Measures a cold usbinfo scan with the io_uring batch reader (SMASH_IO=uring) against the
+# default blocking reads, on a synthetic sysfs tree: DEVICES device directories with the
+# attributes usbinfo reads, each with an interface directory that has no devnum.
+# smash is rebuilt for this with USB_DEVICES_DIR pointing at the tree. Every run is a new
+# smash, so its device table starts empty; the outputs of both modes must be identical.
+#
+# usage: bench/usbinfo_scan.sh [devices] [dir]
+#   devices  number of synthetic devices, default 3000
+#   dir      where the tree and the binary go, default $TMPDIR or /tmp
+# RUNS (default 5, best run reported) can be overridden.
+
+set -e
+
+DEVICES=${1:-3000}
+DIR=${2:-${TMPDIR:-/tmp}}
+RUNS=${RUNS:-5}
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+
+WORK=$(mktemp -d "$DIR/smash_usbinfo_bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+TREE="$WORK/devices"
+BIN="$WORK/smash"
+
+echo "creating $DEVICES devices in $TREE"
+mkdir -p "$TREE"
+for i in $(seq "$DEVICES"); do
+    dev="$TREE/1-$i"
+    mkdir -p "$dev/power" "$dev/1-$i:1.0"
+    echo "$i" > "$dev/devnum"
+    printf '%04x\n' "$i" > "$dev/idVendor"
+    printf '%04x\n' "$((i * 7 % 65536))" > "$dev/idProduct"
+    echo "Vendor $i" > "$dev/manufacturer"
+    echo "Device $i" > "$dev/product"
+    if [ $((i % 4)) -eq 0 ]; then
+        echo "500mA" > "$dev/power/max_power" # only the fallback attribute
+    else
+        echo "100mA" > "$dev/bMaxPower"
+    fi
+    echo "03" > "$dev/1-$i:1.0/bInterfaceClass"
+done
+
+echo "building smash for the tree"
+g++ --std=c++11 -pthread -DUSB_DEVICES_DIR="\"$TREE\"" \
+    "$SRC/Commands.cpp" "$SRC/signals.cpp" "$SRC/smash.cpp" -o "$BIN"
+
+# best wall time in ms over RUNS fresh smash runs of usbinfo, with SMASH_IO set to $1
+best_ms() {
+    local best=""
+    for _ in $(seq "$RUNS"); do
+        local start end
+        start=$(date +%s%N)
+        printf 'usbinfo\n' | SMASH_IO=$1 "$BIN" > "$WORK/out.$1"
+        end=$(date +%s%N)
+        local ms=$(((end - start) / 1000000))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+report() {
+    printf '%-24s %6d ms\n' "$1" "$(best_ms "$2")"
+}
+
+report "usbinfo (blocking)" sync
+report "usbinfo (io_uring)" uring
+cmp -s "$WORK/out.sync" "$WORK/out.uring" || { echo "the two modes print different tables" >&2; exit 1; }
+echo "$(grep -c '' "$WORK/out.sync") lines of output, identical in both modes"
@@ -1,24 +1,442 @@
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <list>
+#include <string>
+#include <unordered_map>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
 #include "signals.h"
 #include "Commands.h"
 
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 using namespace std;
 pid_t foreground_pid = 0;
+bool foreground_is_group = false; // a pipeline is killed as a whole process group
+int foreground_pidfd = -1;
 void ctrlCHandler(int sig_num) {
     cout << "smash: got ctrl-C" << endl;
     if (getForegroundPid() > 0 ) {
-        if (kill(getForegroundPid(), SIGKILL) == 0) {
+        int result = foreground_is_group ? kill(-getForegroundPid(), SIGKILL)
+                                         : sendSignal(getForegroundPid(), foreground_pidfd, SIGKILL);
+        if (result == 0) {
             cout << "smash: process " << getForegroundPid() << " was killed"<< endl;
         }
         foreground_pid = 0;
     }
 }
-void setForegroundPid(pid_t pid) {
+void ctrlZHandler(int sig_num) {
+    cout << "smash: got ctrl-Z" << endl;
+    // only a single foreground process is stopped, it then becomes a stopped job
+    if (getForegroundPid() > 0 && !foreground_is_group) {
+        if (sendSignal(getForegroundPid(), foreground_pidfd, SIGSTOP) == 0) {
+            cout << "smash: process " << getForegroundPid() << " was stopped" << endl;
+        }
+    }
+}
+int openPidfd(pid_t pid) {
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+int sendSignal(pid_t pid, int pidfd, int sig_num) {
+    if (pidfd != -1) {
+        if (syscall(SYS_pidfd_send_signal, pidfd, sig_num, nullptr, 0) == 0) {
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+    }
+    return kill(pid, sig_num);
+}
+
+// timeouts live in a hashed timer wheel: a slot per 100ms tick, and timeouts further away
+// than one turn wait out `rounds` turns in their slot. A tick only visits one slot, so its
+// cost does not grow with the number of armed timeouts. timer_fd ticks while any is armed.
+const unsigned WHEEL_SLOTS = 512;
+const long TICK_NS = 100 * 1000000L;
+const unsigned TICKS_PER_SECOND = 10;
+struct Timeout {
+    unsigned long id;
+    pid_t pid;
+    int sig_num;
+    unsigned rounds;
+    std::string cmd_line;
+};
+std::list<Timeout> wheel[WHEEL_SLOTS];
+std::unordered_map<unsigned long, std::pair<unsigned, std::list<Timeout>::iterator> > armed_timeouts;
+unsigned wheel_pos = 0;
+unsigned long next_timeout_id = 1;
+int timer_fd = -1;
+
+static void setTicking(bool on) {
+    struct itimerspec spec{};
+    if (on) {
+        spec.it_interval.tv_nsec = TICK_NS;
+        spec.it_value.tv_nsec = TICK_NS;
+    }
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) == -1) {
+        perror("smash error: timerfd_settime failed");
+    }
+}
+
+bool timeoutsAvailable() {
+    return timer_fd != -1;
+}
+
+unsigned long addTimeout(pid_t pid, unsigned seconds, int sig_num, const std::string &cmd_line) {
+    if (timer_fd == -1) {
+        return 0;
+    }
+    // one tick more than asked: the current tick is already partly over
+    unsigned long ticks = static_cast<unsigned long>(seconds) * TICKS_PER_SECOND + 1;
+    unsigned slot = (wheel_pos + ticks) % WHEEL_SLOTS;
+    unsigned rounds = static_cast<unsigned>((ticks - 1) / WHEEL_SLOTS);
+    unsigned long id = next_timeout_id++;
+    wheel[slot].push_back(Timeout{id, pid, sig_num, rounds, cmd_line});
+    armed_timeouts[id] = std::make_pair(slot, std::prev(wheel[slot].end()));
+    if (armed_timeouts.size() == 1) {
+        setTicking(true);
+    }
+    return id;
+}
+
+void cancelTimeout(unsigned long id) {
+    auto it = armed_timeouts.find(id);
+    if (it == armed_timeouts.end()) {
+        return;
+    }
+    wheel[it->second.first].erase(it->second.second);
+    armed_timeouts.erase(it);
+    if (armed_timeouts.empty()) {
+        setTicking(false);
+    }
+}
+
+// reported like ctrlCHandler reports a kill; the pid is still ours, every timeout is
+// cancelled when its process is reaped
+static void expireTimeout(const Timeout &timeout) {
+    cout << "smash: got an alarm" << endl;
+    int pidfd = -1;
+    if (timeout.pid == foreground_pid && !foreground_is_group) {
+        pidfd = foreground_pidfd;
+    }
+    else {
+        JobsList::JobEntry *job = SmallShell::getInstance().getJobsList()->getJobByPid(timeout.pid);
+        if (!job) {
+            return;
+        }
+        pidfd = job->pidfd;
+    }
+    if (sendSignal(timeout.pid, pidfd, timeout.sig_num) == 0) {
+        cout << "smash: " << timeout.cmd_line << " timed out!" << endl;
+    }
+}
+
+// advances the wheel by the ticks that passed and fires whatever expired, never blocks
+static void handleTimers() {
+    uint64_t ticks;
+    if (timer_fd == -1 || read(timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+        return;
+    }
+    while (ticks-- > 0 && !armed_timeouts.empty()) {
+        wheel_pos = (wheel_pos + 1) % WHEEL_SLOTS;
+        std::list<Timeout> &slot = wheel[wheel_pos];
+        for (auto it = slot.begin(); it != slot.end();) {
+            if (it->rounds > 0) {
+                it->rounds--;
+                ++it;
+                continue;
+            }
+            Timeout timeout = *it;
+            armed_timeouts.erase(timeout.id);
+            it = slot.erase(it);
+            expireTimeout(timeout);
+        }
+    }
+    if (armed_timeouts.empty()) {
+        setTicking(false);
+    }
+}
+
+// bumped for every SIGCHLD read from the signalfd; SIGCHLD does not queue, so this only
+// tells that some child changed state
+unsigned long child_events = 0;
+unsigned long seen_child_events = 0;
+
+// signals are blocked and read from signal_fd; the input loop waits on epoll_fd
+int signal_fd = -1;
+int epoll_fd = -1;
+bool stdin_pollable = false; // epoll refuses regular files, those never block anyway
+std::string input_buffer;
+size_t input_pos = 0;
+bool input_eof = false;
+
+// undoes a partly set up event loop, keeping the errno of the step that failed
+static void abandonEventLoop(const sigset_t &mask) {
+    int saved_errno = errno;
+    if (signal_fd != -1) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    errno = saved_errno;
+}
+
+bool initEventLoop() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+        return false;
+    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || epoll_fd == -1) {
+        abandonEventLoop(mask);
+        return false;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = signal_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1) {
+        abandonEventLoop(mask);
+        return false;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.data.fd = timer_fd;
+    if (timer_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    ev.data.fd = STDIN_FILENO;
+    stdin_pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    return true;
+}
+
+bool installSignalHandlers() {
+    // no SA_RESTART: the blocking wait4 and read of the fallback paths retry on EINTR
+    struct sigaction action{};
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = ctrlCHandler;
+    if (sigaction(SIGINT, &action, nullptr) == -1) {
+        return false;
+    }
+    action.sa_handler = ctrlZHandler;
+    return sigaction(SIGTSTP, &action, nullptr) == 0;
+}
+
+// runs the handlers of every signal received and every timeout expired so far, never blocks
+void handleSignals() {
+    handleTimers();
+    if (signal_fd == -1) {
+        return;
+    }
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGINT:
+                ctrlCHandler(SIGINT);
+                break;
+            case SIGTSTP:
+                ctrlZHandler(SIGTSTP);
+                break;
+            case SIGCHLD:
+                child_events++;
+                break;
+        }
+    }
+}
+
+// true if a child changed state since the last call, the caller then has to reap with WNOHANG
+bool takeChildEvents() {
+    handleSignals();
+    if (signal_fd == -1) {
+        return true; // no signalfd, so no way to know: always reap
+    }
+    if (child_events == seen_child_events) {
+        return false;
+    }
+    seen_child_events = child_events;
+    return true;
+}
+
+bool readCommandLine(std::string &line) {
+    cout.flush();
+    for (;;) {
+        size_t newline = input_buffer.find('\n', input_pos);
+        if (newline != std::string::npos) {
+            line.assign(input_buffer, input_pos, newline - input_pos);
+            input_pos = newline + 1;
+            return true;
+        }
+        if (input_eof) {
+            if (input_pos == input_buffer.size()) {
+                return false;
+            }
+            line.assign(input_buffer, input_pos, std::string::npos);
+            input_pos = input_buffer.size();
+            return true;
+        }
+
+        if (stdin_pollable) {
+            struct epoll_event events[3];
+            int n = epoll_wait(epoll_fd, events, 3, -1);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("smash error: epoll_wait failed");
+                return false;
+            }
+            bool readable = false;
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == signal_fd || events[i].data.fd == timer_fd) {
+                    handleSignals();
+                }
+                else {
+                    readable = true;
+                }
+            }
+            if (!readable) {
+                continue;
+            }
+        }
+        else {
+            handleSignals();
+        }
+
+        input_buffer.erase(0, input_pos);
+        input_pos = 0;
+        char chunk[65536];
+        ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("smash error: read failed");
+            return false;
+        }
+        if (n == 0) {
+            input_eof = true;
+        }
+        input_buffer.append(chunk, n);
+    }
+}
+
+struct rusage foreground_usage{};
+
+struct rusage takeForegroundUsage() {
+    struct rusage usage = foreground_usage;
+    foreground_usage = rusage{};
+    return usage;
+}
+
+static void addTime(struct timeval &total, const struct timeval &time) {
+    total.tv_sec += time.tv_sec;
+    total.tv_usec += time.tv_usec;
+    if (total.tv_usec >= 1000000) {
+        total.tv_sec++;
+        total.tv_usec -= 1000000;
+    }
+}
+
+static void addUsage(struct rusage &total, const struct rusage &usage) {
+    addTime(total.ru_utime, usage.ru_utime);
+    addTime(total.ru_stime, usage.ru_stime);
+    total.ru_maxrss = std::max(total.ru_maxrss, usage.ru_maxrss);
+    total.ru_nvcsw += usage.ru_nvcsw;
+    total.ru_nivcsw += usage.ru_nivcsw;
+}
+
+// pipeline stages the group wait gave up on; they are reaped by removeFinishedJobs
+int stray_children = 0;
+
+int getStrayChildren() {
+    return stray_children;
+}
+
+void addStrayChildren(int delta) {
+    stray_children = std::max(0, stray_children + delta);
+}
+
+int waitForeground(pid_t pid, bool is_group, int count, struct rusage *reaped_usage) {
+    cout.flush();
+    // the pidfd becomes readable when the child exits and pins it against pid reuse;
+    // stops are only reported by SIGCHLD, so the signalfd is watched as well
+    int pidfd = is_group ? -1 : openPidfd(pid);
+    setForegroundPid(pid, is_group, pidfd);
+    pid_t target = is_group ? -pid : pid;
+    int options = is_group ? 0 : WUNTRACED;
+    int status = 0;
+    struct rusage usage;
+    while (count > 0) {
+        pid_t done = wait4(target, &status, options | (signal_fd == -1 ? 0 : WNOHANG), &usage);
+        if (done > 0) {
+            if (WIFSTOPPED(status)) {
+                break;
+            }
+            addUsage(foreground_usage, usage);
+            if (reaped_usage) {
+                addUsage(*reaped_usage, usage);
+            }
+            count--;
+            continue;
+        }
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // still running: sleep until it exits, a signal arrives or a timeout ticks
+        struct pollfd pfds[3] = {};
+        pfds[0].fd = signal_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = timer_fd;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = pidfd;
+        pfds[2].events = POLLIN;
+        if (poll(pfds, pidfd == -1 ? 2 : 3, -1) == -1 && errno != EINTR) {
+            perror("smash error: poll failed");
+            break;
+        }
+        handleSignals();
+    }
+    if (is_group && count > 0) {
+        addStrayChildren(count); // e.g. a stage that exited before it could join the group
+    }
+    setForegroundPid(0);
+    if (pidfd != -1) {
+        close(pidfd);
+    }
+    return status;
+}
+
+void setForegroundPid(pid_t pid, bool is_group, int pidfd) {
     foreground_pid = pid;
+    foreground_is_group = is_group;
+    foreground_pidfd = pidfd;
 }
 pid_t getForegroundPid() {
     return foreground_pid;
 }
-
-
@@ -1,7 +1,45 @@
 #ifndef SMASH__SIGNALS_H_
 #define SMASH__SIGNALS_H_
+#include <string>
+#include <sys/resource.h>
+#include <sys/types.h>
 
 void ctrlCHandler(int sig_num);
-void setForegroundPid(pid_t pid);
+void ctrlZHandler(int sig_num);
+
+// blocks SIGINT/SIGTSTP/SIGCHLD and routes them through a signalfd watched by the input loop
+bool initEventLoop();
+// fallback when initEventLoop fails: plain handlers, so ctrl-C and ctrl-Z never hit smash itself
+bool installSignalHandlers();
+void handleSignals();
+bool takeChildEvents();
+// reads the next input line, handling signals while waiting; false at end of input
+bool readCommandLine(std::string &line);
+// waits until the foreground process (or `count` members of its group) exited or it was
+// stopped, handling signals meanwhile; returns the last wait status. The usage of what it
+// reaped is added to reaped_usage, if given, as well as to takeForegroundUsage's total
+int waitForeground(pid_t pid, bool is_group = false, int count = 1, struct rusage *reaped_usage = nullptr);
+// the resources of every foreground child reaped since the last call (times and context
+// switches summed, the largest max RSS), then starts over
+struct rusage takeForegroundUsage();
+// children that are neither waited for in the foreground nor jobs: pipeline stages a
+// group wait could not reap. removeFinishedJobs only polls wait4(-1) for them while some exist
+int getStrayChildren();
+void addStrayChildren(int delta);
+
+// pidfd_open(2), -1 where the kernel lacks it
+int openPidfd(pid_t pid);
+// pidfd_send_signal(2) when a pidfd is available, kill(2) otherwise
+int sendSignal(pid_t pid, int pidfd, int sig_num);
+
+// false if the timerfd could not be set up, addTimeout then arms nothing
+bool timeoutsAvailable();
+// after `seconds`, sends sig_num to pid (the foreground process or a job) and reports
+// "<cmd_line> timed out!"; returns an id for cancelTimeout, 0 if timeouts are unavailable
+unsigned long addTimeout(pid_t pid, unsigned seconds, int sig_num, const std::string &cmd_line);
+// drops a timeout that has not fired yet, a no-op for one that already did
+void cancelTimeout(unsigned long id);
+
+void setForegroundPid(pid_t pid, bool is_group = false, int pidfd = -1);
 pid_t getForegroundPid();
 #endif //SMASH__SIGNALS_H_
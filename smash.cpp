@@ -1,22 +1,117 @@
 #include <iostream>
+#include <cerrno>
+#include <clocale>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include "Commands.h"
 #include "signals.h"
 
+// cout keeps its own buffer (no stdio sync); executeCommand flushes it once per command
+static char output_buffer[1 << 16];
+
+// runs every line of a script without prompts; the file is mapped instead of read line by line
+static int runScript(SmallShell &smash, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("smash error: open failed");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("smash error: fstat failed");
+        close(fd);
+        return 1;
+    }
+    size_t size = st.st_size;
+    std::string contents;
+    const char *data = nullptr;
+    void *map = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(map);
+    }
+    else {
+        // not mappable (a pipe or /dev/stdin), read it in blocks instead
+        char chunk[65536];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("smash error: read failed");
+                break;
+            }
+            contents.append(chunk, n);
+        }
+        data = contents.data();
+        size = contents.size();
+    }
+    close(fd);
+
+    std::string cmd_line;
+    size_t released = 0; // the mapped pages before this offset were handed back
+    for (size_t pos = 0; pos < size;) {
+        const char *newline = static_cast<const char *>(memchr(data + pos, '\n', size - pos));
+        size_t end = newline ? newline - data : size;
+        cmd_line.assign(data + pos, end - pos);
+        pos = end + 1;
+        handleSignals();
+        smash.executeCommand(cmd_line.c_str());
+        if (map != MAP_FAILED && pos - released >= (1 << 20) && pos < size) {
+            // keep the RSS flat for huge scripts: drop the pages already executed
+            madvise(static_cast<char *>(map) + released, 1 << 20, MADV_DONTNEED);
+            released += 1 << 20;
+        }
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (signal(SIGINT, ctrlCHandler) == SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
+    const char *script = nullptr;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        script = argv[2];
+    }
+    else if (argc != 1) {
+        std::cerr << "smash error: usage: smash [-f script]" << std::endl;
+        return 1;
+    }
+
+    setlocale(LC_COLLATE, ""); // glob results are sorted like bash sorts them
+    std::ios::sync_with_stdio(false);
+    std::cout.rdbuf()->pubsetbuf(output_buffer, sizeof(output_buffer));
+
+    if (!initEventLoop()) {
+        perror("smash error: failed to set signal handling");
+        if (!installSignalHandlers()) {
+            perror("smash error: failed to set ctrl-C handler");
+        }
     }
 
 
     SmallShell &smash = SmallShell::getInstance();
+    if (script) {
+        int result = runScript(smash, script);
+        smash.dumpStats();
+        return result;
+    }
+    std::string cmd_line;
     while (true) {
-        std::cout << smash.getPrompt() << ">";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
+        std::cout << smash.getPrompt() << "> ";
+        if (!readCommandLine(cmd_line)) {
+            break;
+        }
         smash.executeCommand(cmd_line.c_str());
     }
+    smash.dumpStats();
     return 0;
-}
\ No newline at end of file
+}